@@ -0,0 +1,79 @@
+#ifndef ANALYZE_HPP
+#define ANALYZE_HPP
+
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+// For uint64_t
+#include <cstdint>
+
+#include "pipeline.hpp"
+
+// Distance histograms use log2 buckets: bucket b counts [2^b, 2^(b+1))
+static const int ANALYSIS_BUCKETS = 32;
+
+// Outcomes of one static branch
+struct BranchSite {
+    uint64_t count, taken;
+    uint64_t changes; // Executions whose outcome differs from the previous one
+    bool first, last; // First and last outcome, for stitching chunks
+};
+
+/*
+ * Static characteristics of a trace, gathered in one pass. Chunks of the
+ * trace are analysed independently and merged in trace order; dependencies
+ * crossing a chunk boundary are resolved from each chunk's edge state.
+ */
+struct TraceAnalysis {
+    uint64_t instructions = 0;
+    uint64_t fu_counts[4] = {}; // By FU type -1..2
+    uint64_t branches = 0, taken = 0;
+
+    // Source operand to the instruction that produced it, in instructions
+    uint64_t dep_distance[ANALYSIS_BUCKETS] = {};
+    uint64_t no_producer = 0; // Sources read before any write to the register
+
+    // Register write to the last read of that value, in instructions
+    uint64_t lifetime[ANALYSIS_BUCKETS] = {};
+    uint64_t dead_writes = 0; // Values overwritten or left unread
+
+    std::unordered_map<int64_t, BranchSite> sites;
+
+    // Edge state per register: reads before the chunk's first write, and
+    // the chunk's last write with the last read after it (-1 if none)
+    std::vector<std::vector<int64_t>> open_reads;
+    std::vector<int64_t> first_write, last_write, last_read;
+
+    // Share of instructions of a FU type (-1 counted as its own type)
+    inline double fu_share(int type) const {
+        return instructions ? static_cast<double>(fu_counts[type + 1]) / instructions : 0;
+    }
+
+    // Fold a later chunk into this one
+    void merge(const TraceAnalysis& next);
+
+    // Close values still live at the end of the trace
+    void finish();
+};
+
+// Analyse a trace across num_threads workers (0 = one per core)
+void analyze_trace(TraceView trace, TraceAnalysis& result, int num_threads = 0);
+
+// Compact "key: value" report; procopt --auto reads the same numbers
+void write_analysis(std::ostream& out, const TraceAnalysis& a);
+
+// Phase fingerprints: an interval's instructions binned by static address
+static const int PHASE_BUCKETS = 32;
+
+/*
+ * Split a trace into phases of whole intervals (the last one takes the
+ * remainder) and return each phase's first position, starting with 0. An
+ * interval opens a new phase when its fingerprint is more than threshold
+ * from the current phase's average, as the Manhattan distance between
+ * fingerprints normalised to sum to 1 (so 0..2). Like SimPoint's basic
+ * block vectors, this tracks which code runs rather than how it performs.
+ */
+std::vector<size_t> split_phases(TraceView trace, size_t interval, double threshold);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <string>
+#include <vector>
+
+// For uint64_t
+#include <cstdint>
+
+// Memory hierarchy parameters; latencies are cycles added to execute
+struct MemoryOptions {
+    bool enabled;
+    int line_size; // Bytes, power of two
+    int l1_size, l1_assoc, l1_latency; // Size in bytes
+    int l2_size, l2_assoc, l2_latency;
+    int mem_latency;
+};
+
+// Parse "default" or "L1KB,L1WAYS,L1LAT,L2KB,L2WAYS,L2LAT,MEMLAT"
+bool parse_memory_spec(const std::string& spec, MemoryOptions& opt, std::string& err);
+
+/*
+ * Set-associative cache with true LRU replacement. Each set's tags are
+ * packed next to each other, most recently used first, so a lookup is one
+ * vector compare per 2 ways and a hit or fill just shifts the set.
+ */
+class Cache {
+public:
+    Cache(int size, int assoc, int line_size);
+
+    // Look up addr; on a miss the line is filled. Returns true on a hit.
+    bool access(uint64_t addr);
+
+    uint64_t hits = 0, misses = 0;
+
+private:
+    int assoc;
+    int line_bits, set_bits;
+    uint64_t set_mask;
+
+    // sets * assoc tags; tag + 1 is stored so that 0 marks an invalid way
+    std::vector<uint64_t> tags;
+
+    int find(const uint64_t* set, uint64_t tag) const;
+};
+
+// L1 backed by L2 backed by memory
+class MemoryHierarchy {
+public:
+    MemoryHierarchy(const MemoryOptions& opt);
+
+    // Extra execute cycles for an access to addr
+    int access(uint64_t addr);
+
+    Cache l1, l2;
+
+private:
+    MemoryOptions options;
+};
+
+#endif
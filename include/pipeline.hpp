@@ -1,15 +1,40 @@
 #ifndef PIPELINE_HPP
 #define PIPELINE_HPP
 
-#include <deque>
 #include <list>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
 
 // For uint64_t
 #include <cstdint>
 
+#include "cache.hpp"
 #include "predictor.hpp"
+#include "ring_queue.hpp"
+#include "timing_wheel.hpp"
+
+class HotspotProfile;
+class PipeViewWriter;
+
+// Causes a cycle's unused issue slots can be charged to; BASE is the
+// share of the cycle spent doing useful issue
+enum StallCause {
+    BASE,
+    FRONTEND, // Fetch/dispatch bandwidth or latency
+    MISPREDICT, // Dispatch stalled on a mispredicted branch
+    SCHED_FULL, // No free sched_q slot for the next instruction
+    DEPENDENCY, // Waiting instructions with operands not yet ready
+    FU_BUSY, // Ready instructions with no free FU of their type
+    RESULT_BUS, // Completed instructions waiting for a free result bus
+    DRAIN, // End of trace, nothing left to fetch
+    MEMORY, // Waiting on cache misses (memory model only)
+    NUM_STALL_CAUSES
+};
+
+const char* stall_cause_name(int cause);
 
 struct Stats {
     uint64_t total_instructions;
@@ -22,9 +47,30 @@ struct Stats {
     uint64_t total_branches;
     uint64_t correct_branches;
     double prediction_accuracy;
+
+    // CPI stack: cycles charged to each cause, and the same divided by the
+    // instruction count. cpi_stack sums to cycle_count / total_instructions.
+    double stall_cycles[NUM_STALL_CAUSES];
+    double cpi_stack[NUM_STALL_CAUSES];
+
+    // Early termination (PipelineOptions::converge_tol). When converged,
+    // the per-cycle stats cover only the simulated_instructions retired.
+    bool converged;
+    uint64_t simulated_instructions;
+    double ipc_error; // 95% CI half-width of avg_inst_retired; 0 if not estimated
+
+    // Memory model (PipelineOptions::mem)
+    uint64_t l1_hits, l1_misses, l2_hits, l2_misses;
+
+    // Steady-state memoisation (PipelineOptions::memo): cycles replayed
+    // from a confirmed loop period instead of being simulated
+    uint64_t memo_cycles;
+
+    // Cycles taken over from the base run (Pipeline::start_from)
+    uint64_t resumed_cycles;
 };
 
-enum Stage {
+enum Stage : uint8_t {
     FETCH,
     DISP,
     SCHED,
@@ -35,10 +81,11 @@ enum Stage {
 };
 
 struct ROBEntry {
-    int inst_idx;
-    int ip; // Instruction pointer
-    int tag, value, dest_reg;
-    int address;
+    int64_t inst_idx;
+    int64_t ip; // Instruction pointer
+    int64_t tag;
+    int value, dest_reg;
+    int64_t address;
     bool branch, taken, p_taken;
     bool complete;
 };
@@ -51,129 +98,353 @@ enum Misprediction {
 
 struct PipelineOptions {
     int F, J, K, L, R;
+
+    // Stop once the 95% confidence interval of IPC is narrower than this
+    // fraction of the estimate (batch means); 0 runs the whole trace
+    double converge_tol;
+
+    // Optional cache hierarchy driven by Instruction::addr
+    MemoryOptions mem;
+
+    // Capacities of fetch_q and dispatch_q; fetch and dispatch stall when
+    // the next queue is full. 0 = unbounded, as in the original model.
+    int fetch_q_size, disp_q_size;
+
+    // Replay repeated loop iterations instead of simulating them; results
+    // are unchanged. Ignored with converge_tol, mem, a profile or pipeview.
+    bool memo;
+
+    // Execute latency of each FU type in cycles (0 = 1). A pipelined unit
+    // takes a new instruction every cycle, up to latency in flight; any
+    // other unit takes one at a time.
+    int latency[3];
+    bool pipelined[3];
 };
 
 struct PipelineEntry {
-    int tag;
+    int64_t tag;
     uint64_t cycle;
-    int inst_idx;
+    int64_t inst_idx;
     int rs_idx;
-    bool dummy = false;
+    int fu_idx; // Unit executing it, until its result is on a bus
 };
 
 struct PipelineStages {
-    std::list<PipelineEntry> sched;
-    std::list<PipelineEntry> exec;
+    TimingWheel<PipelineEntry> exec; // In flight, by the cycle the result is due
+    std::vector<PipelineEntry> exec_done; // Due, waiting for a result bus
     std::list<PipelineEntry> update;
     std::list<PipelineEntry> retire;
 };
 
-// Single instruction as parsed from trace file
+// Single instruction as parsed from trace file; its index is its position.
+// Addresses are 64-bit; FU types (-1..2) and register numbers (-1..127) fit
+// in a byte each.
 struct Instruction {
-    int idx;
-    int addr;
-    int ip;
-    int fu_type;
-    int dest_reg;
-    int src_reg[2];
-    int branch_addr = -1;
+    int64_t addr;
+    int64_t branch_addr = -1;
+    int8_t fu_type;
+    int8_t dest_reg;
+    int8_t src_reg[2];
     bool taken = false; // Actual branch result
-    bool p_taken = false; // Predicted branch result
 };
 
-// Store status of every instruction in the trace
+// Front-end queue entry: a trace position plus the state a run attaches to
+// the instruction, so the shared trace is never copied or written
+struct InstRef {
+    int64_t idx;
+    bool p_taken; // Predicted branch result, set at dispatch
+};
+
+// Read-only view of a decoded trace. Backed by a vector or by a mapping
+// such as the shared trace cache; the owner must outlive the view.
+struct TraceView {
+    const Instruction* data = NULL;
+    size_t count = 0;
+
+    TraceView() {}
+    TraceView(const std::vector<Instruction>& v) : data(v.data()), count(v.size()) {}
+    TraceView(const Instruction* d, size_t n) : data(d), count(n) {}
+
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+    inline const Instruction& operator[](size_t i) const { return data[i]; }
+};
+
+// Store status of every instruction in the trace, one array per field and
+// indexed by trace position. The stage is the only field touched after the
+// instruction enters it; timestamps are write-once and read at output time.
+//
+// Timestamps keep the low 32 bits of the cycle, which keeps the arrays
+// small on long traces. Fetch cycles only grow along the trace, so the
+// first instruction fetched in each later 2^32-cycle epoch is enough to
+// recover the full fetch cycle, and an instruction spends less than 2^32
+// cycles in the pipeline, so its later stages count from there.
 struct InstStatus {
-    int idx;
-    Stage stage;
-    int inst; // Position of inst. in instructions vector
-    bool dummy = false;
+    std::vector<Stage> stage;
+
+    // Clock cycle at which instruction entered stage, low 32 bits
+    std::vector<uint32_t> fetch, disp, sched, exec, state;
+
+    // epochs[e] is the first instruction fetched in epoch e + 1
+    std::vector<size_t> epochs;
+
+    inline size_t size() const { return stage.size(); }
+
+    // Full cycle of a timestamp of instruction i
+    inline uint64_t fetch_cycle(size_t i) const {
+        if (epochs.empty())
+            return fetch[i];
+
+        uint64_t epoch = std::upper_bound(epochs.begin(), epochs.end(), i) - epochs.begin();
+        return (epoch << 32) | fetch[i];
+    }
 
-    // Clock cycle at which instruction entered stage
-    long fetch, disp, sched, exec, state;
+    inline uint64_t cycle(const std::vector<uint32_t>& field, size_t i) const {
+        return cycle(field, i, fetch_cycle(i));
+    }
+
+    // Same, reusing the full fetch cycle when reading several fields of i
+    inline uint64_t cycle(const std::vector<uint32_t>& field, size_t i, uint64_t fetched) const {
+        return fetched + static_cast<uint32_t>(field[i] - fetch[i]);
+    }
+
+    inline void reserve(size_t n) {
+        stage.reserve(n);
+        fetch.reserve(n);
+        disp.reserve(n);
+        sched.reserve(n);
+        exec.reserve(n);
+        state.reserve(n);
+    }
+
+    // Track a newly fetched instruction
+    inline void push_back(uint64_t cycle) {
+        while ((cycle >> 32) > epochs.size())
+            epochs.push_back(stage.size());
+
+        stage.push_back(Stage::FETCH);
+        fetch.push_back(static_cast<uint32_t>(cycle));
+        disp.push_back(0);
+        sched.push_back(0);
+        exec.push_back(0);
+        state.push_back(0);
+    }
 };
 
 // "Reservation Station"
-// An entry in the scheduling queue
+// An entry in the scheduling queue. This is a timing-only model, so no
+// operand values are carried; only tags and ready bits matter.
+// Tags and positions are full 64-bit trace positions rather than 32-bit
+// offsets into the in-flight window: the queue holds 2 * (J + K + L)
+// entries, so the wider entries stay in L1 and cost no measurable time.
 struct RS {
-    bool empty = true;
-    int fu_type;
-    int dest_reg;
-    int dest_tag;
+    int64_t dest_tag;
+    int64_t src1_tag = -1;
+    int64_t src2_tag = -1;
+    int64_t inst_idx;
+    int8_t fu_type;
+    int8_t dest_reg;
     bool src1_ready;
-    int src1_tag = -1;
-    int src1_value = -1;
     bool src2_ready;
-    int src2_tag = -1;
-    int src2_value = -1;
-    int inst_idx;
+    bool empty = true;
 };
 
 struct ResultBus {
     int fu_id = -1;
+    int64_t tag;
+    int reg_no;
+    int64_t inst_idx;
     bool busy = false;
-    int value, tag, reg_no;
-    int inst_idx;
 };
 
 struct FU {
     int id; // Uniquely identifies a FU in the table
     int type;
-    int value = -1, dest = -1, tag = -1;
-    int inst_idx;
-    bool busy = false;
+    int in_flight = 0; // Issued and not yet on a result bus
+    uint64_t last_issue = UINT64_MAX; // Cycle of the latest issue
 };
 
 // Register as stored in register file
 struct Register {
-    int num, tag, value;
+    int num;
+    int64_t tag;
     bool ready;
     bool empty;
 };
 
+// One cycle's contribution to the stats, logged while a candidate loop
+// period is confirmed so later periods can be replayed from it
+struct MemoCycle {
+    int fetched;
+    int retired;
+    uint64_t disp_size;
+    double used; // Issue share charged to BASE
+    int cause; // Cause charged the rest, NUM_STALL_CAUSES if none
+};
+
+// Machine position at the start of a candidate loop period
+struct MemoMark {
+    uint64_t clock;
+    uint64_t completed;
+    uint64_t branches, correct_branches;
+    int64_t tag;
+    int64_t lo; // Oldest instruction in sched_q (or the dispatch_q head)
+    int64_t disp_head, fetch_head; // First instruction in dispatch_q / fetch_q
+};
+
+class Pipeline;
+
+// Owning pointer that copies its object along with it, so a copy of a
+// Pipeline (a resume snapshot) gets its own predictor and caches instead
+// of sharing them with the original
+template <typename T>
+struct ClonePtr : std::unique_ptr<T> {
+    ClonePtr() = default;
+    ClonePtr(ClonePtr&&) = default;
+    ClonePtr& operator=(ClonePtr&&) = default;
+
+    ClonePtr(const ClonePtr& other) : std::unique_ptr<T>(other ? new T(*other) : nullptr) {}
+
+    ClonePtr& operator=(const ClonePtr& other) {
+        if (this != &other)
+            this->reset(other ? new T(*other) : nullptr);
+        return *this;
+    }
+};
+
+// Resources whose first shortage a resumable run records; FU_n are the kn units
+enum Resource {
+    RES_FU0,
+    RES_FU1,
+    RES_FU2,
+    RES_SCHED_Q,
+    RES_RB,
+    NUM_RESOURCES
+};
+
+// What a resumable run keeps so runs with more resources can pick up from
+// it: the first cycle each resource ran short, with the latest snapshot
+// taken at or before that cycle
+struct ResumeState {
+    uint64_t next_snapshot;
+    std::shared_ptr<const Pipeline> latest;
+    uint64_t short_at[NUM_RESOURCES];
+    std::shared_ptr<const Pipeline> before[NUM_RESOURCES];
+    MemoMark at; // Queue positions, in a snapshot
+};
+
 class Pipeline {
 public:
-    std::vector<InstStatus> status;
+    InstStatus status;
     uint64_t num_completed = 0;
 
     Stats proc_stats;
 
-    Pipeline(std::vector<Instruction>& ins, PipelineOptions& opt);
+    Pipeline(TraceView ins, const PipelineOptions& opt);
 
     void start();
 
+    // Snapshot the machine now and then and note where each resource first
+    // runs short, so start_from() can reuse the run. Set before starting;
+    // ignored with a profile or pipeview.
+    bool resumable = false;
+
+    // Same results as start(). When base is a finished resumable run of
+    // the same trace and options but no more FUs, sched_q slots or result
+    // buses than this one, the two runs agree up to the first cycle base
+    // ran short of something this one has more of; pick up from base's
+    // snapshot before that cycle instead of simulating from the start.
+    void start_from(const Pipeline& base);
+
+    // Prefix runs: advance(n) simulates until at least n instructions have
+    // retired, or the run ends, and pauses there; a later call with a
+    // larger n continues from the same machine state. finish() then
+    // collects the stats of what ran. Advancing to the end of the trace
+    // gives the same results as start().
+    void advance(uint64_t completed);
+    void finish();
+
+    // Whether a started run can't go any further: the trace is done, or it
+    // was cancelled or converged
+    inline bool ended() const {
+        return started && (num_completed >= instructions.size() || cancelled || proc_stats.converged);
+    }
+
+    // Cycles simulated so far
+    inline uint64_t cycles() const { return clock; }
+
+    // Optional flag polled by start(); when set, the run stops early
+    const std::atomic<bool>* cancel = NULL;
+    bool cancelled = false;
+
+    // Optional per-address profile, filled in as instructions retire
+    HotspotProfile* profile = NULL;
+
+    // Optional stage-transition log for the pipeline viewer
+    PipeViewWriter* pipeview = NULL;
+
 private:
+    // Snapshots only; they leave out status and the front-end queues
+    Pipeline(const Pipeline&) = default;
+    Pipeline& operator=(const Pipeline&) = default;
+
     uint64_t clock;
 
     PipelineOptions options;
     PipelineStages stages = {};
-    void sort_stage(std::vector<PipelineEntry>& l, Stage s);
 
-    std::deque<Instruction> dispatch_q;
-    std::deque<Instruction> fetch_q;
+    RingQueue<InstRef> dispatch_q;
+    RingQueue<InstRef> fetch_q;
 
     std::vector<RS> sched_q;
-    void schedq_insert(Instruction& inst, RS& rs);
+    void schedq_insert(const Instruction& inst, int64_t idx, RS& rs);
     int schedq_size = 0;
 
+    // Issue selection state over sched_q slots, one bit per slot
+    int sched_words = 0;
+    std::vector<uint64_t> pending; // Occupied and not yet issued
+    std::vector<uint64_t> ready[3]; // Pending with both operands ready, per FU type
+    std::vector<uint64_t> age; // Row i: pending slots older than slot i
+    void sched_track(int rs_idx);
+    void sched_update_ready(int rs_idx);
+    int sched_select(int type); // Oldest ready slot for a FU type, or -1
+
     std::vector<ResultBus> result_buses;
-    int rb_find_tag(int tag); // Returns ResultBus id which is broadcasting this tag, or -1
+    int rb_find_tag(int64_t tag); // Returns ResultBus id which is broadcasting this tag, or -1
 
     std::vector<FU> fu_table;
     int find_fu(int type);
-    int find_fu_by_tag(int tag);
+
+    // Cycles an instruction of a FU type spends executing
+    inline int fu_latency(int type) const {
+        return std::max(1, options.latency[type]);
+    }
 
     int num_regs = 128;
     std::vector<Register> reg_file;
 
-    std::vector<Instruction>& instructions;
-    int ip; // Instruction pointer
+    TraceView instructions;
+    int64_t ip; // Instruction pointer
+
+    // Cache hierarchy, NULL unless options.mem.enabled
+    ClonePtr<MemoryHierarchy> memory;
 
     // Branch prediction support
-    BranchPredictor* predictor;
+    ClonePtr<BranchPredictor> predictor;
     Misprediction mp;
+    int64_t mp_idx; // Trace index of the mispredicted branch, -1 if none
 
     // Init the pipeline
     void init();
+    bool started = false; // init() has run
+
+    // Cycle loop and final stats, from wherever the machine is
+    void run();
+
+    // Cycle loop alone, until `completed` instructions have retired; memo
+    // replay stops short of pause_at too
+    void loop(uint64_t completed);
+    uint64_t pause_at = UINT64_MAX;
 
     // Pipeline "stages"
     // 1. Fetch unit
@@ -186,18 +457,56 @@ private:
     // 3. Scheduling unit
     void schedule();
     void check_buses();
-    void wake_up();
+    int wake_up();
 
     // 4. Execution unit
     void execute();
+    bool rb_stall = false; // Some completed instruction found no free RB this cycle
+
+    // Charge this cycle's unused issue slots to a single stall cause
+    void account_cycle(int issued);
+
+    // Steady-state memoisation
+    bool memo = false;
+    bool memo_confirming = false; // Simulating a candidate period to check it
+    uint64_t memo_period = 0;
+    MemoMark memo_mark;
+    MemoCycle memo_cycle; // Filled in as the current cycle runs
+    std::vector<MemoCycle> memo_log;
+    std::vector<int64_t> memo_key; // State at memo_mark
+    std::unordered_map<uint64_t, uint64_t> memo_seen; // State hash -> clock
+    void memo_position(MemoMark& mark);
+    void memo_state(std::vector<int64_t>& key, int64_t disp_head);
+    uint64_t memo_periodic(int64_t start, int64_t from, int64_t step, uint64_t k);
+    void memo_step();
+    void memo_replay();
+
+    // Resuming (see start_from)
+    ResumeState resume = {};
+    void take_snapshot();
+    void grow_resources();
+    void restore_status(const InstStatus& full);
+
+    inline void note_short(Resource r) {
+        if (resumable && resume.short_at[r] == UINT64_MAX) {
+            resume.short_at[r] = clock;
+            resume.before[r] = resume.latest;
+        }
+    }
+
+    // Batch means for early termination
+    uint64_t batch_start_completed = 0;
+    uint64_t num_batches = 0;
+    double batch_sum = 0, batch_sum_sq = 0;
+    bool check_convergence();
 
     // 5. State update unit
     void state_update();
     int retire();
 
     // Tag generation
-    int curr_tag = 0;
-    inline int get_tag() {
+    int64_t curr_tag = 0;
+    inline int64_t get_tag() {
         return curr_tag++;
     }
 };
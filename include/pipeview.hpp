@@ -0,0 +1,83 @@
+#ifndef PIPEVIEW_HPP
+#define PIPEVIEW_HPP
+
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// For uint64_t
+#include <cstdint>
+
+#include "pipeline.hpp"
+
+// Stage transitions recorded for the pipeline viewer
+enum PipeViewStage : uint8_t {
+    PV_FETCH,
+    PV_DISP,
+    PV_SCHED, // resource = sched_q slot
+    PV_EXEC, // resource = FU id
+    PV_UPDATE, // resource = result bus
+    PV_RETIRE,
+    PV_MISPREDICT // Branch stalled dispatch; not a stage of its own
+};
+
+struct PipeViewEvent {
+    uint64_t cycle;
+    int64_t inst;
+    int resource;
+    PipeViewStage stage;
+};
+
+/*
+ * Writes stage transitions for a window of instructions in the Kanata log
+ * format read by the Konata pipeline viewer. The cycle loop only appends
+ * fixed-size events to a batch; a background thread formats and writes
+ * full batches.
+ */
+class PipeViewWriter {
+public:
+    ~PipeViewWriter();
+
+    // Record instructions first..last (trace indices, inclusive)
+    bool open(const std::string& file, TraceView trace, int64_t first, int64_t last, std::string& err);
+
+    // Flush remaining events and wait for the writer thread
+    void close();
+
+    inline void record(uint64_t cycle, int64_t inst, PipeViewStage stage, int resource = -1) {
+        if (inst < first || inst > last)
+            return;
+
+        batch.push_back({cycle, inst, resource, stage});
+
+        if (batch.size() >= BATCH_SIZE)
+            submit();
+    }
+
+private:
+    static const size_t BATCH_SIZE = 1 << 14;
+
+    std::ofstream out;
+    TraceView trace;
+    int64_t first = 0, last = -1;
+
+    std::vector<PipeViewEvent> batch;
+
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<std::vector<PipeViewEvent>> full; // Batches waiting for the writer
+    bool done = false;
+
+    uint64_t last_cycle = 0;
+    bool started = false;
+
+    void submit();
+    void run();
+    void write_event(const PipeViewEvent& ev);
+};
+
+#endif
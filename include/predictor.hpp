@@ -3,6 +3,9 @@
 
 #include <vector>
 
+// For int64_t, uint64_t
+#include <cstdint>
+
 /*
  * Implementation of n-entry k-bit Smith counter GSelect with GHR.
  * All Smith counter initialized to 01. GHR = 000 by default.
@@ -10,8 +13,11 @@
 class BranchPredictor {
 public:
     BranchPredictor(int n, int k);
-    bool predict(int address);
-    void update(int address, bool taken);
+    bool predict(uint64_t address);
+    void update(uint64_t address, bool taken);
+
+    // Append the GHR and every counter, for comparing predictor states
+    void snapshot(std::vector<int64_t>& out) const;
     inline int get_ghr() { return ghr; }
 private:
     std::vector<std::vector<int>> prediction_table;
@@ -21,6 +27,10 @@ private:
 
     int ghr;
     int ghr_size; // Size of GHR, in bits
+
+    inline int index(uint64_t address) const {
+        return static_cast<int>((address / 4) % static_cast<uint64_t>(n));
+    }
 };
 
 #endif
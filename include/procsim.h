@@ -0,0 +1,69 @@
+#ifndef PROCSIM_H
+#define PROCSIM_H
+
+/*
+ * C interface to libprocsim. All functions returning int return 0 on
+ * success and -1 on failure; procsim_last_error() describes the failure.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct procsim_sim procsim_sim;
+
+// Entries of procsim_stats.cpi_stack, in order: base, frontend, mispredict,
+// sched_full, dependency, fu_busy, result_bus, drain, memory
+#define PROCSIM_NUM_STALL_CAUSES 9
+
+typedef struct {
+    int F, J, K, L, R;
+    double converge_tol; // 0 = simulate the whole trace
+} procsim_options;
+
+typedef struct {
+    uint64_t total_instructions;
+    uint64_t total_disp_size;
+    double avg_inst_retired;
+    double avg_inst_issue;
+    double avg_disp_size;
+    uint64_t max_disp_size;
+    uint64_t cycle_count;
+    uint64_t total_branches;
+    uint64_t correct_branches;
+    double prediction_accuracy;
+    double cpi_stack[PROCSIM_NUM_STALL_CAUSES];
+    int converged;
+    uint64_t simulated_instructions;
+    double ipc_error;
+} procsim_stats;
+
+// Cycle at which an instruction entered each stage
+typedef struct {
+    uint64_t fetch, disp, sched, exec, state;
+} procsim_timing;
+
+procsim_sim* procsim_create(void);
+void procsim_destroy(procsim_sim* sim);
+
+int procsim_load_trace(procsim_sim* sim, const char* path);
+uint64_t procsim_trace_size(const procsim_sim* sim);
+
+// timings may be NULL; otherwise it must hold procsim_trace_size() entries
+int procsim_run(procsim_sim* sim, const procsim_options* opt,
+                procsim_stats* stats, procsim_timing* timings);
+
+// Run n configurations; stats must hold n entries
+int procsim_run_batch(procsim_sim* sim, const procsim_options* opts, size_t n,
+                      procsim_stats* stats);
+
+const char* procsim_last_error(const procsim_sim* sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
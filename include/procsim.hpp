@@ -1,4 +1,46 @@
 #ifndef PROCSIM_HPP
 #define PROCSIM_HPP
 
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "pipeline.hpp"
+
+/*
+ * In-process interface to the simulator (libprocsim).
+ * A Simulator loads a trace once and runs any number of pipeline
+ * configurations against it. Errors are returned, never exit()ed on.
+ */
+
+// Called after each run of a batch with the run's position in the batch
+typedef std::function<void(size_t run, const PipelineOptions& opt,
+                           const Stats& stats, const InstStatus& status)> RunCallback;
+
+class Simulator {
+public:
+    // Parse a text trace, replacing any trace already loaded
+    bool load_trace(const std::string& file, std::string& err);
+
+    // Use an already decoded trace
+    void set_trace(const std::vector<Instruction>& ins);
+
+    inline const std::vector<Instruction>& trace() const { return instructions; }
+
+    // Simulate one configuration. If status is non-NULL, it receives the
+    // per-instruction stage timings of the run.
+    bool run(const PipelineOptions& opt, Stats& stats, std::string& err, InstStatus* status = NULL);
+
+    // Simulate each configuration in order; stats[i] belongs to opts[i].
+    // Stops at the first invalid configuration.
+    bool run_batch(const std::vector<PipelineOptions>& opts, std::vector<Stats>& stats,
+                   std::string& err, const RunCallback& cb = RunCallback());
+
+private:
+    std::vector<Instruction> instructions;
+};
+
+// Check that a configuration can make progress (every FU type present, etc.)
+bool validate_options(const PipelineOptions& opt, std::string& err);
+
 #endif
@@ -0,0 +1,52 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <ostream>
+#include <vector>
+
+// For uint64_t
+#include <cstdint>
+
+// Aggregated behaviour of one static instruction (one trace address)
+struct HotspotEntry {
+    int64_t addr;
+    uint64_t count; // Dynamic executions
+    uint64_t mispredicts;
+
+    // Cycle totals: dispatch queue, scheduling queue, execute to state update
+    uint64_t disp_wait, sched_wait, exec;
+
+    inline uint64_t total_cycles() const { return disp_wait + sched_wait + exec; }
+};
+
+/*
+ * Per-address hotspot profile. Entries live in an open-addressing table
+ * (linear probing, power-of-two size) so recording stays cheap inside the
+ * cycle loop.
+ */
+class HotspotProfile {
+public:
+    HotspotProfile(size_t capacity = 1024);
+
+    void record(int64_t addr, uint32_t disp_wait, uint32_t sched_wait, uint32_t exec);
+    void record_mispredict(int64_t addr);
+
+    inline size_t size() const { return entries; }
+
+    // The n static instructions with the most total cycles, most first
+    std::vector<HotspotEntry> top(size_t n) const;
+
+    // Table of top(n) with per-execution averages
+    void write(std::ostream& out, size_t n) const;
+
+private:
+    std::vector<HotspotEntry> table;
+    std::vector<bool> used;
+    size_t mask;
+    size_t entries = 0;
+
+    HotspotEntry& find(int64_t addr);
+    void grow();
+};
+
+#endif
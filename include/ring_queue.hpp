@@ -0,0 +1,79 @@
+#ifndef RING_QUEUE_HPP
+#define RING_QUEUE_HPP
+
+#include <vector>
+
+// For SIZE_MAX
+#include <cstdint>
+
+/*
+ * FIFO on a power-of-two ring buffer. With a limit the buffer is allocated
+ * once and full() tells producers to stall; with limit 0 the queue is
+ * unbounded and the buffer doubles when it fills up.
+ */
+template <typename T>
+class RingQueue {
+public:
+    explicit RingQueue(size_t limit = 0) {
+        reset(limit);
+    }
+
+    // Empty the queue and set its capacity (0 = unbounded)
+    void reset(size_t limit) {
+        size_t size = 16;
+        while (size < limit)
+            size <<= 1;
+
+        this->limit = limit;
+        buf.assign(size, T());
+        mask = size - 1;
+        head = count = 0;
+    }
+
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+    inline bool full() const { return limit != 0 && count >= limit; }
+
+    // Free slots, SIZE_MAX if unbounded
+    inline size_t space() const { return limit == 0 ? SIZE_MAX : limit - count; }
+
+    inline T& operator[](size_t i) { return buf[(head + i) & mask]; }
+    inline const T& operator[](size_t i) const { return buf[(head + i) & mask]; }
+    inline T& front() { return buf[head]; }
+
+    inline void push_back(const T& v) {
+        if (count == buf.size())
+            grow();
+
+        buf[(head + count) & mask] = v;
+        count++;
+    }
+
+    inline void pop_front() {
+        head = (head + 1) & mask;
+        count--;
+    }
+
+    inline void clear() {
+        head = count = 0;
+    }
+
+private:
+    std::vector<T> buf;
+    size_t mask;
+    size_t head, count;
+    size_t limit;
+
+    void grow() {
+        std::vector<T> bigger (buf.size() * 2);
+
+        for (size_t i = 0; i < count; i++)
+            bigger[i] = (*this)[i];
+
+        buf.swap(bigger);
+        mask = buf.size() - 1;
+        head = 0;
+    }
+};
+
+#endif
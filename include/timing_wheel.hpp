@@ -0,0 +1,93 @@
+#ifndef TIMING_WHEEL_HPP
+#define TIMING_WHEEL_HPP
+
+#include <utility>
+#include <vector>
+
+// For uint64_t
+#include <cstdint>
+
+/*
+ * Calendar queue of items keyed by the cycle they fall due. Slot
+ * cycle % span holds the items for that cycle, so taking a cycle's items
+ * touches only them. Items more than span cycles out share a slot with
+ * earlier ones and wait there for their lap.
+ */
+template <typename T>
+class TimingWheel {
+public:
+    TimingWheel(size_t span = 16) {
+        reset(span);
+    }
+
+    // Empty the wheel; span is rounded up to a power of two
+    void reset(size_t span) {
+        size_t size = 1;
+        while (size < span)
+            size <<= 1;
+
+        slots.assign(size, std::vector<std::pair<uint64_t, T>>());
+        mask = size - 1;
+        count = 0;
+    }
+
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+
+    // Add an item due at a cycle not yet taken
+    inline void push(uint64_t due, const T& item) {
+        slots[due & mask].push_back(std::make_pair(due, item));
+        count++;
+    }
+
+    // Append the items due at cycle now to out, in the order pushed.
+    // Every cycle must be taken in turn for nothing to be missed.
+    void take(uint64_t now, std::vector<T>& out) {
+        std::vector<std::pair<uint64_t, T>>& slot = slots[now & mask];
+        size_t kept = 0;
+
+        for (size_t i = 0; i < slot.size(); i++) {
+            if (slot[i].first == now)
+                out.push_back(slot[i].second);
+            else
+                slot[kept++] = slot[i];
+        }
+
+        count -= slot.size() - kept;
+        slot.resize(kept);
+    }
+
+    // Move every item, with its due cycle, to out
+    void drain(std::vector<std::pair<uint64_t, T>>& out) {
+        for (std::vector<std::pair<uint64_t, T>>& slot: slots) {
+            out.insert(out.end(), slot.begin(), slot.end());
+            slot.clear();
+        }
+
+        count = 0;
+    }
+
+    // Call f(due, item) for every item, slot by slot
+    template <typename F>
+    void for_each(F f) {
+        for (std::vector<std::pair<uint64_t, T>>& slot: slots) {
+            for (std::pair<uint64_t, T>& e: slot)
+                f(e.first, e.second);
+        }
+    }
+
+    template <typename F>
+    void for_each(F f) const {
+        for (const std::vector<std::pair<uint64_t, T>>& slot: slots) {
+            for (const std::pair<uint64_t, T>& e: slot)
+                f(e.first, e.second);
+        }
+    }
+
+private:
+    std::vector<std::vector<std::pair<uint64_t, T>>> slots;
+    size_t mask;
+    size_t count;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TRACE_CACHE_HPP
+#define TRACE_CACHE_HPP
+
+#include <string>
+#include <sys/stat.h>
+
+#include "pipeline.hpp"
+
+/*
+ * Shared-memory trace cache.
+ *
+ * The first process to open a trace parses it and publishes the decoded
+ * instructions in a POSIX shared-memory segment named after the trace's
+ * path. Processes that open the same trace while the segment exists map it
+ * read-only instead of parsing. The segment records the file's size and
+ * mtime and is rebuilt if the file changed. The last process to detach
+ * removes it; a process killed while attached leaves it behind until the
+ * trace file changes.
+ */
+class SharedTrace {
+public:
+    ~SharedTrace();
+
+    // Attach to (or publish) the cached copy of file
+    bool open(const std::string& file, std::string& err);
+    void close();
+
+    inline bool is_open() const { return header != NULL; }
+    inline bool published() const { return publisher; }
+    TraceView view() const;
+
+private:
+    struct Header;
+
+    std::string name; // Segment name, derived from the trace path
+    int fd = -1;
+    Header* header = NULL;
+    const Instruction* data = NULL;
+    size_t count = 0;
+    bool publisher = false;
+    bool referenced = false; // Holds one of the segment's references
+
+    bool publish(const std::string& file, const struct stat& sb, std::string& err);
+    bool attach(const struct stat& sb, bool& retry, std::string& err);
+    void fail_publish(); // Mark the segment FAILED, unlink and unmap it
+    void unmap();
+};
+
+#endif
@@ -8,10 +8,35 @@
 struct InputArgs {
     int R, F, J, K, L;
     std::string trace_file;
+    bool shm_cache; // Share the decoded trace with other processes (-s)
+    int profile_top; // Hotspot profile size, 0 = off (-p)
+    int64_t view_first, view_last; // Pipeline view window, 1-based inclusive; 0 = off (-v)
+    double converge_tol; // Stop early once IPC is known to this relative precision (-c)
+    std::string mem_spec; // Cache hierarchy, see parse_memory_spec(); empty = off (-m)
+    int fetch_q_size, disp_q_size; // Front-end queue capacities, 0 = unbounded (-q)
+    int latency[3]; // Execute latency per FU type, 0 = 1 cycle (-x)
+    bool pipelined[3]; // Pipelined FUs per type (-x)
+    int memo; // Replay repeated loop iterations (-z); 2 = also check against a full run (-Z)
+    bool analyze; // Characterise the trace instead of simulating it (--analyze)
 };
 
 void parse_args(int argc, char **argv, InputArgs& args);
+
+// Parse queue capacities "FETCH:DISPATCH" (or one value for both); 0 = unbounded
+bool parse_queue_sizes(const std::string& spec, int& fetch_q_size, int& disp_q_size);
+
+// Parse a convergence tolerance: a finite number greater than 0
+bool parse_tolerance(const std::string& s, double& tol);
+
+// Parse FU latencies "K0,K1,K2", each optionally followed by 'p' for
+// pipelined units, e.g. "1,3p,12"
+bool parse_fu_latencies(const std::string& spec, int latency[3], bool pipelined[3]);
 void exit_on_error(const std::string& msg);
-void parse_trace(std::string file, std::vector<Instruction>& instructions);
+// Parse a text trace into instructions. The file is mapped and split across
+// num_threads workers (0 = one per core); output order matches the file.
+void parse_trace(std::string file, std::vector<Instruction>& instructions, int num_threads = 0);
+
+// Same as parse_trace(), but reports failure through err instead of exiting
+bool load_trace(const std::string& file, std::vector<Instruction>& instructions, std::string& err, int num_threads = 0);
 
 #endif
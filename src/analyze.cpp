@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <thread>
+
+#include "analyze.hpp"
+
+// Register numbers in the trace are 0..127, -1 for none
+static const int NUM_REGS = 128;
+
+// Don't split traces into chunks smaller than this; threads would dominate
+static const size_t MIN_CHUNK = 1 << 16;
+
+static inline int bucket(uint64_t d) {
+    return std::min(63 - __builtin_clzll(d), ANALYSIS_BUCKETS - 1);
+}
+
+// A value written at `write` and last read at `read` (-1 if never) is gone
+static inline void close_value(TraceAnalysis& a, int64_t write, int64_t read) {
+    if (read == -1)
+        a.dead_writes++;
+    else
+        a.lifetime[bucket(read - write)]++;
+}
+
+static void analyze_chunk(TraceView trace, size_t begin, size_t end, TraceAnalysis& a) {
+    a.open_reads.assign(NUM_REGS, std::vector<int64_t>());
+    a.first_write.assign(NUM_REGS, -1);
+    a.last_write.assign(NUM_REGS, -1);
+    a.last_read.assign(NUM_REGS, -1);
+
+    for (size_t i = begin; i < end; i++) {
+        const Instruction& inst = trace[i];
+        int64_t pos = static_cast<int64_t>(i);
+
+        a.instructions++;
+        a.fu_counts[inst.fu_type + 1]++;
+
+        // Sources are read before the destination is written
+        for (int s = 0; s < 2; s++) {
+            int r = inst.src_reg[s];
+            if (r < 0)
+                continue;
+
+            if (a.last_write[r] == -1) {
+                a.open_reads[r].push_back(pos);
+            } else {
+                a.dep_distance[bucket(pos - a.last_write[r])]++;
+                a.last_read[r] = pos;
+            }
+        }
+
+        int d = inst.dest_reg;
+        if (d >= 0) {
+            if (a.last_write[d] != -1)
+                close_value(a, a.last_write[d], a.last_read[d]);
+            else
+                a.first_write[d] = pos;
+
+            a.last_write[d] = pos;
+            a.last_read[d] = -1;
+        }
+
+        if (inst.branch_addr != -1) {
+            a.branches++;
+            a.taken += inst.taken;
+
+            std::unordered_map<int64_t, BranchSite>::iterator it = a.sites.find(inst.addr);
+
+            if (it == a.sites.end()) {
+                a.sites[inst.addr] = {1, inst.taken ? 1ULL : 0ULL, 0, inst.taken, inst.taken};
+            } else {
+                BranchSite& site = it->second;
+                site.count++;
+                site.taken += inst.taken;
+                site.changes += site.last != inst.taken;
+                site.last = inst.taken;
+            }
+        }
+    }
+}
+
+void TraceAnalysis::merge(const TraceAnalysis& next) {
+    instructions += next.instructions;
+    branches += next.branches;
+    taken += next.taken;
+    no_producer += next.no_producer;
+    dead_writes += next.dead_writes;
+
+    for (int t = 0; t < 4; t++)
+        fu_counts[t] += next.fu_counts[t];
+
+    for (int b = 0; b < ANALYSIS_BUCKETS; b++) {
+        dep_distance[b] += next.dep_distance[b];
+        lifetime[b] += next.lifetime[b];
+    }
+
+    // The next chunk's leading reads consume our last values
+    for (int r = 0; r < NUM_REGS; r++) {
+        for (int64_t pos: next.open_reads[r]) {
+            if (last_write[r] == -1) {
+                open_reads[r].push_back(pos);
+            } else {
+                dep_distance[bucket(pos - last_write[r])]++;
+                last_read[r] = pos;
+            }
+        }
+
+        if (next.first_write[r] != -1) {
+            if (last_write[r] != -1)
+                close_value(*this, last_write[r], last_read[r]);
+            else
+                first_write[r] = next.first_write[r];
+
+            last_write[r] = next.last_write[r];
+            last_read[r] = next.last_read[r];
+        }
+    }
+
+    for (const std::pair<const int64_t, BranchSite>& s: next.sites) {
+        std::unordered_map<int64_t, BranchSite>::iterator it = sites.find(s.first);
+
+        if (it == sites.end()) {
+            sites.insert(s);
+        } else {
+            BranchSite& site = it->second;
+            site.count += s.second.count;
+            site.taken += s.second.taken;
+            site.changes += s.second.changes + (site.last != s.second.first);
+            site.last = s.second.last;
+        }
+    }
+}
+
+void TraceAnalysis::finish() {
+    for (int r = 0; r < NUM_REGS; r++) {
+        no_producer += open_reads[r].size();
+        open_reads[r].clear();
+
+        if (last_write[r] != -1)
+            close_value(*this, last_write[r], last_read[r]);
+
+        first_write[r] = last_write[r] = last_read[r] = -1;
+    }
+}
+
+void analyze_trace(TraceView trace, TraceAnalysis& result, int num_threads) {
+    if (num_threads <= 0)
+        num_threads = static_cast<int>(std::thread::hardware_concurrency());
+
+    size_t n = trace.size();
+    size_t chunks = std::min<size_t>(std::max(num_threads, 1), n / MIN_CHUNK + 1);
+
+    std::vector<TraceAnalysis> parts (chunks);
+    std::vector<std::thread> workers;
+
+    for (size_t i = 1; i < chunks; i++)
+        workers.push_back(std::thread(analyze_chunk, trace, n * i / chunks, n * (i + 1) / chunks, std::ref(parts[i])));
+
+    // Calling thread takes the first chunk
+    analyze_chunk(trace, 0, n / chunks, parts[0]);
+
+    for (std::thread& t: workers)
+        t.join();
+
+    result = parts[0];
+
+    for (size_t i = 1; i < chunks; i++)
+        result.merge(parts[i]);
+
+    result.finish();
+}
+
+std::vector<size_t> split_phases(TraceView trace, size_t interval, double threshold) {
+    size_t n = trace.size();
+    size_t intervals = std::max<size_t>(n / std::max<size_t>(interval, 1), 1);
+
+    std::vector<size_t> starts = {0};
+    double phase[PHASE_BUCKETS] = {};
+    size_t phase_intervals = 0;
+
+    for (size_t k = 0; k < intervals; k++) {
+        size_t begin = k * interval;
+        size_t end = k + 1 == intervals ? n : begin + interval;
+
+        double sig[PHASE_BUCKETS] = {};
+        for (size_t i = begin; i < end; i++) {
+            // Fibonacci hash; the top 5 bits pick one of the 32 buckets
+            uint64_t h = static_cast<uint64_t>(trace[i].addr) * 0x9E3779B97F4A7C15ULL;
+            sig[h >> 59] += 1.0 / (end - begin);
+        }
+
+        if (phase_intervals > 0) {
+            double distance = 0;
+            for (int b = 0; b < PHASE_BUCKETS; b++)
+                distance += std::fabs(sig[b] - phase[b] / phase_intervals);
+
+            if (distance > threshold) {
+                starts.push_back(begin);
+                std::fill(phase, phase + PHASE_BUCKETS, 0.0);
+                phase_intervals = 0;
+            }
+        }
+
+        for (int b = 0; b < PHASE_BUCKETS; b++)
+            phase[b] += sig[b];
+        phase_intervals++;
+    }
+
+    return starts;
+}
+
+// "1=0.31 2-3=0.2 4-7=..." up to the last non-empty bucket
+static void write_histogram(std::ostream& out, const uint64_t* hist, uint64_t total) {
+    int last = ANALYSIS_BUCKETS - 1;
+    while (last > 0 && hist[last] == 0)
+        last--;
+
+    for (int b = 0; b <= last; b++) {
+        uint64_t lo = 1ULL << b;
+        out << (b ? " " : "") << lo;
+        if (b > 0)
+            out << "-" << (2 * lo - 1);
+        out << "=" << (total ? static_cast<double>(hist[b]) / total : 0);
+    }
+
+    out << std::endl;
+}
+
+void write_analysis(std::ostream& out, const TraceAnalysis& a) {
+    std::streamsize old_precision = out.precision(4);
+    double n = a.instructions ? static_cast<double>(a.instructions) : 1;
+
+    out << "instructions: " << a.instructions << std::endl;
+    out << "fu_mix: -1=" << a.fu_share(-1) << " 0=" << a.fu_share(0) << " 1=" << a.fu_share(1);
+    out << " 2=" << a.fu_share(2) << std::endl;
+
+    out << "branch_density: " << a.branches / n << std::endl;
+    out << "taken_rate: " << (a.branches ? static_cast<double>(a.taken) / a.branches : 0) << std::endl;
+
+    uint64_t deps = 0, values = 0;
+    for (int b = 0; b < ANALYSIS_BUCKETS; b++) {
+        deps += a.dep_distance[b];
+        values += a.lifetime[b];
+    }
+
+    out << "dep_distance: ";
+    write_histogram(out, a.dep_distance, deps);
+    out << "no_producer: " << (deps + a.no_producer ? static_cast<double>(a.no_producer) / (deps + a.no_producer) : 0) << std::endl;
+
+    out << "lifetime: ";
+    write_histogram(out, a.lifetime, values);
+    out << "dead_writes: " << (values + a.dead_writes ? static_cast<double>(a.dead_writes) / (values + a.dead_writes) : 0) << std::endl;
+
+    // Predictability: how often a site goes its usual way, weighted by executions
+    uint64_t majority = 0, biased = 0, changes = 0;
+    std::vector<std::pair<int64_t, BranchSite>> sites (a.sites.begin(), a.sites.end());
+
+    for (const std::pair<int64_t, BranchSite>& s: sites) {
+        uint64_t m = std::max(s.second.taken, s.second.count - s.second.taken);
+        majority += m;
+        changes += s.second.changes;
+
+        if (m >= 0.9 * s.second.count)
+            biased += s.second.count;
+    }
+
+    double b = a.branches ? static_cast<double>(a.branches) : 1;
+    out << "static_branches: " << sites.size() << std::endl;
+    out << "branch_bias: " << majority / b << std::endl;
+    out << "biased_branches: " << biased / b << std::endl;
+    out << "outcome_changes: " << changes / b << std::endl;
+
+    // Sites that cost the most minority outcomes, worst first
+    std::sort(sites.begin(), sites.end(), [](const std::pair<int64_t, BranchSite>& x, const std::pair<int64_t, BranchSite>& y) {
+        uint64_t mx = std::min(x.second.taken, x.second.count - x.second.taken);
+        uint64_t my = std::min(y.second.taken, y.second.count - y.second.taken);
+        return mx != my ? mx > my : x.first < y.first;
+    });
+
+    out << "hardest_branches:";
+    for (size_t i = 0; i < sites.size() && i < 5; i++) {
+        const BranchSite& s = sites[i].second;
+        out << " " << std::hex << sites[i].first << std::dec << "=" << s.count << "/";
+        out << static_cast<double>(s.taken) / s.count;
+    }
+    out << std::endl;
+
+    out.precision(old_precision);
+}
@@ -0,0 +1,199 @@
+#include <new>
+#include <string>
+#include <vector>
+
+#include "procsim.hpp"
+#include "procsim.h"
+#include "util.hpp"
+
+bool validate_options(const PipelineOptions& opt, std::string& err) {
+    if (opt.F < 1) {
+        err = "F must be at least 1";
+        return false;
+    }
+
+    // Instructions of a type with no FUs would never issue
+    if (opt.J < 1 || opt.K < 1 || opt.L < 1) {
+        err = "J, K and L must each be at least 1";
+        return false;
+    }
+
+    if (opt.R < 1) {
+        err = "R must be at least 1";
+        return false;
+    }
+
+    for (int t = 0; t < 3; t++) {
+        if (opt.latency[t] < 0) {
+            err = "FU latencies must not be negative";
+            return false;
+        }
+    }
+
+    if (opt.converge_tol < 0) {
+        err = "Convergence tolerance must not be negative";
+        return false;
+    }
+
+    return true;
+}
+
+bool Simulator::load_trace(const std::string& file, std::string& err) {
+    std::vector<Instruction> ins;
+
+    if (!::load_trace(file, ins, err))
+        return false;
+
+    instructions.swap(ins);
+    return true;
+}
+
+void Simulator::set_trace(const std::vector<Instruction>& ins) {
+    instructions = ins;
+}
+
+bool Simulator::run(const PipelineOptions& opt, Stats& stats, std::string& err, InstStatus* status) {
+    if (instructions.empty()) {
+        err = "No trace loaded";
+        return false;
+    }
+
+    if (!validate_options(opt, err))
+        return false;
+
+    Pipeline p (instructions, opt);
+    p.start();
+
+    stats = p.proc_stats;
+
+    if (status != NULL)
+        std::swap(*status, p.status);
+
+    return true;
+}
+
+bool Simulator::run_batch(const std::vector<PipelineOptions>& opts, std::vector<Stats>& stats,
+                          std::string& err, const RunCallback& cb) {
+    stats.clear();
+    stats.reserve(opts.size());
+
+    InstStatus status;
+
+    for (size_t i = 0; i < opts.size(); i++) {
+        Stats s;
+
+        if (!run(opts[i], s, err, cb ? &status : NULL))
+            return false;
+
+        stats.push_back(s);
+
+        if (cb)
+            cb(i, opts[i], s, status);
+    }
+
+    return true;
+}
+
+/*
+ * C interface
+ */
+
+struct procsim_sim {
+    Simulator sim;
+    std::string error;
+};
+
+static PipelineOptions to_options(const procsim_options* opt) {
+    PipelineOptions o = {};
+    o.F = opt->F;
+    o.J = opt->J;
+    o.K = opt->K;
+    o.L = opt->L;
+    o.R = opt->R;
+    o.converge_tol = opt->converge_tol;
+    return o;
+}
+
+static void to_stats(const Stats& s, procsim_stats* out) {
+    out->total_instructions = s.total_instructions;
+    out->total_disp_size = s.total_disp_size;
+    out->avg_inst_retired = s.avg_inst_retired;
+    out->avg_inst_issue = s.avg_inst_issue;
+    out->avg_disp_size = s.avg_disp_size;
+    out->max_disp_size = s.max_disp_size;
+    out->cycle_count = s.cycle_count;
+    out->total_branches = s.total_branches;
+    out->correct_branches = s.correct_branches;
+    out->prediction_accuracy = s.prediction_accuracy;
+
+    for (int c = 0; c < NUM_STALL_CAUSES && c < PROCSIM_NUM_STALL_CAUSES; c++)
+        out->cpi_stack[c] = s.cpi_stack[c];
+
+    out->converged = s.converged ? 1 : 0;
+    out->simulated_instructions = s.simulated_instructions;
+    out->ipc_error = s.ipc_error;
+}
+
+extern "C" {
+
+procsim_sim* procsim_create(void) {
+    return new (std::nothrow) procsim_sim;
+}
+
+void procsim_destroy(procsim_sim* sim) {
+    delete sim;
+}
+
+int procsim_load_trace(procsim_sim* sim, const char* path) {
+    if (path == NULL) {
+        sim->error = "No trace path given";
+        return -1;
+    }
+
+    return sim->sim.load_trace(path, sim->error) ? 0 : -1;
+}
+
+uint64_t procsim_trace_size(const procsim_sim* sim) {
+    return sim->sim.trace().size();
+}
+
+int procsim_run(procsim_sim* sim, const procsim_options* opt,
+                procsim_stats* stats, procsim_timing* timings) {
+    Stats s;
+    InstStatus status;
+
+    if (!sim->sim.run(to_options(opt), s, sim->error, timings ? &status : NULL))
+        return -1;
+
+    to_stats(s, stats);
+
+    if (timings != NULL) {
+        for (size_t i = 0; i < status.size(); i++) {
+            uint64_t fetched = status.fetch_cycle(i);
+
+            timings[i].fetch = fetched;
+            timings[i].disp = status.cycle(status.disp, i, fetched);
+            timings[i].sched = status.cycle(status.sched, i, fetched);
+            timings[i].exec = status.cycle(status.exec, i, fetched);
+            timings[i].state = status.cycle(status.state, i, fetched);
+        }
+    }
+
+    return 0;
+}
+
+int procsim_run_batch(procsim_sim* sim, const procsim_options* opts, size_t n,
+                      procsim_stats* stats) {
+    for (size_t i = 0; i < n; i++) {
+        if (procsim_run(sim, &opts[i], &stats[i], NULL) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+const char* procsim_last_error(const procsim_sim* sim) {
+    return sim->error.c_str();
+}
+
+}
@@ -0,0 +1,163 @@
+#include <climits>
+#include <cstdlib>
+#include <sstream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "cache.hpp"
+
+// Largest cache accepted, in KB (1 GB)
+static const int MAX_CACHE_KB = 1 << 20;
+
+static int log2_exact(int v) {
+    int bits = 0;
+    while ((1 << bits) < v)
+        bits++;
+    return (1 << bits) == v ? bits : -1;
+}
+
+bool parse_memory_spec(const std::string& spec, MemoryOptions& opt, std::string& err) {
+    // 32KB 8-way L1 on top of the FU cycle, 256KB 8-way L2 at +8, memory at +100
+    int v[7] = {32, 8, 0, 256, 8, 8, 100};
+
+    if (spec != "default") {
+        std::istringstream iss (spec);
+        std::string item;
+        int n = 0;
+
+        while (n < 7 && getline(iss, item, ',')) {
+            char* end = NULL;
+            long x = strtol(item.c_str(), &end, 10);
+
+            if (end == item.c_str() || *end != '\0' || x < INT_MIN || x > INT_MAX) {
+                err = "Bad memory spec '" + spec + "'";
+                return false;
+            }
+
+            v[n++] = static_cast<int>(x);
+        }
+
+        if (n != 7 || !iss.eof()) {
+            err = "Memory spec needs L1KB,L1WAYS,L1LAT,L2KB,L2WAYS,L2LAT,MEMLAT";
+            return false;
+        }
+    }
+
+    if (v[0] < 1 || v[0] > MAX_CACHE_KB || v[3] < 1 || v[3] > MAX_CACHE_KB) {
+        err = "Cache sizes must be 1 to " + std::to_string(MAX_CACHE_KB) + " KB";
+        return false;
+    }
+
+    opt = {};
+    opt.enabled = true;
+    opt.line_size = 64;
+    opt.l1_size = v[0] * 1024;
+    opt.l1_assoc = v[1];
+    opt.l1_latency = v[2];
+    opt.l2_size = v[3] * 1024;
+    opt.l2_assoc = v[4];
+    opt.l2_latency = v[5];
+    opt.mem_latency = v[6];
+
+    const int caches[][2] = {{opt.l1_size, opt.l1_assoc}, {opt.l2_size, opt.l2_assoc}};
+
+    for (const int* c: caches) {
+        int size = c[0], assoc = c[1];
+
+        // Lines per way, divided step by step so a huge assoc can't overflow
+        if (assoc < 1 || size / opt.line_size < assoc || log2_exact(size / opt.line_size / assoc) == -1) {
+            err = "Cache size / (ways * 64) must be a power of two";
+            return false;
+        }
+    }
+
+    if (opt.l1_latency < 0 || opt.l2_latency < 0 || opt.mem_latency < 0) {
+        err = "Memory latencies must not be negative";
+        return false;
+    }
+
+    return true;
+}
+
+Cache::Cache(int size, int assoc, int line_size) : assoc(assoc) {
+    int sets = size / (assoc * line_size);
+
+    line_bits = log2_exact(line_size);
+    set_bits = log2_exact(sets);
+    set_mask = static_cast<uint64_t>(sets - 1);
+
+    tags.assign(static_cast<size_t>(sets) * assoc, 0);
+}
+
+int Cache::find(const uint64_t* set, uint64_t tag) const {
+    int w = 0;
+
+#ifdef __SSE2__
+    // Compare 2 packed tags per instruction; SSE2 has no 64-bit compare, so
+    // a tag matches where both of its 32-bit halves do
+    __m128i key = _mm_set1_epi64x(static_cast<long long>(tag));
+
+    for (; w + 2 <= assoc; w += 2) {
+        __m128i ways = _mm_loadu_si128(reinterpret_cast<const __m128i*>(set + w));
+        __m128i eq = _mm_cmpeq_epi32(ways, key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+
+        if (mask != 0)
+            return w + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; w < assoc; w++) {
+        if (set[w] == tag)
+            return w;
+    }
+
+    return -1;
+}
+
+bool Cache::access(uint64_t addr) {
+    uint64_t line = addr >> line_bits;
+    uint64_t tag = (line >> set_bits) + 1;
+    uint64_t* set = &tags[static_cast<size_t>(line & set_mask) * assoc];
+
+    int way = find(set, tag);
+    bool hit = way != -1;
+
+    // On a miss the LRU way (last) is evicted
+    if (!hit)
+        way = assoc - 1;
+
+    // Move to the MRU position
+    for (int w = way; w > 0; w--)
+        set[w] = set[w - 1];
+    set[0] = tag;
+
+    if (hit)
+        hits++;
+    else
+        misses++;
+
+    return hit;
+}
+
+MemoryHierarchy::MemoryHierarchy(const MemoryOptions& opt)
+        : l1(opt.l1_size, opt.l1_assoc, opt.line_size),
+          l2(opt.l2_size, opt.l2_assoc, opt.line_size),
+          options(opt) {}
+
+int MemoryHierarchy::access(uint64_t addr) {
+    int latency = options.l1_latency;
+
+    if (l1.access(addr))
+        return latency;
+
+    latency += options.l2_latency;
+
+    if (l2.access(addr))
+        return latency;
+
+    return latency + options.mem_latency;
+}
@@ -1,14 +1,89 @@
 #include <algorithm>
+#include <climits>
+#include <cmath>
 
 #include "pipeline.hpp"
+#include "pipeview.hpp"
+#include "profile.hpp"
+
+// Early termination: cycles per batch, batches dropped as warmup, and
+// batches needed before the interval is trusted
+static const uint64_t CONVERGE_BATCH = 1000;
+static const uint64_t CONVERGE_WARMUP = 1;
+static const uint64_t CONVERGE_MIN_BATCHES = 20;
+
+// Memoisation: cycles between state probes, longest loop period looked for,
+// and how many probe hashes are kept before starting over
+static const uint64_t MEMO_PROBE = 64;
+static const uint64_t MEMO_MAX_PERIOD = 1 << 16;
+static const size_t MEMO_MAX_SEEN = 1 << 16;
+
+// Resuming: cycles between snapshots of a resumable run
+static const uint64_t RESUME_SNAPSHOT = 512;
+
+// Single-bit helpers for the sched_q slot masks
+static inline void bit_set(std::vector<uint64_t>& m, int i) {
+    m[i >> 6] |= 1ULL << (i & 63);
+}
+
+static inline void bit_clear(std::vector<uint64_t>& m, int i) {
+    m[i >> 6] &= ~(1ULL << (i & 63));
+}
+
+const char* stall_cause_name(int cause) {
+    static const char* names[] = {"base", "frontend", "mispredict", "sched_full",
+                                  "dependency", "fu_busy", "result_bus", "drain", "memory"};
+
+    if (cause < 0 || cause >= NUM_STALL_CAUSES)
+        return "unknown";
+
+    return names[cause];
+}
+
+// Instructions that behave the same in the pipeline; only whether there's a
+// branch matters, not its target
+static inline bool same_inst(const Instruction& a, const Instruction& b) {
+    return a.addr == b.addr && a.fu_type == b.fu_type && a.dest_reg == b.dest_reg &&
+           a.src_reg[0] == b.src_reg[0] && a.src_reg[1] == b.src_reg[1] &&
+           (a.branch_addr != -1) == (b.branch_addr != -1) && a.taken == b.taken;
+}
+
+// FU type -1 is executed on k1 units
+static inline int issue_type(int fu_type) {
+    return fu_type == -1 ? 1 : fu_type;
+}
+
+// Runs with the same options, except resources, make the same decisions
+// until one runs short of something the other has more of
+static bool same_setup(const PipelineOptions& a, const PipelineOptions& b) {
+    const MemoryOptions& m = a.mem;
+    const MemoryOptions& n = b.mem;
+
+    if (m.enabled != n.enabled)
+        return false;
+
+    if (m.enabled && (m.line_size != n.line_size || m.l1_size != n.l1_size || m.l1_assoc != n.l1_assoc ||
+                      m.l1_latency != n.l1_latency || m.l2_size != n.l2_size || m.l2_assoc != n.l2_assoc ||
+                      m.l2_latency != n.l2_latency || m.mem_latency != n.mem_latency))
+        return false;
+
+    for (int t = 0; t < 3; t++) {
+        if (std::max(1, a.latency[t]) != std::max(1, b.latency[t]) || a.pipelined[t] != b.pipelined[t])
+            return false;
+    }
+
+    return a.F == b.F && a.converge_tol == b.converge_tol &&
+           a.fetch_q_size == b.fetch_q_size && a.disp_q_size == b.disp_q_size;
+}
 
-Pipeline::Pipeline(std::vector<Instruction>& ins, PipelineOptions& opt)
+Pipeline::Pipeline(TraceView ins, const PipelineOptions& opt)
         : options(opt), instructions(ins) {}
 
 void Pipeline::init() {
     // Init IP and clock
     ip = 0;
     clock = 0;
+    started = true;
     int i, j;
 
     // Setup FU table
@@ -37,16 +112,23 @@ void Pipeline::init() {
 
     // Initialize the register file
     for (int i = 0; i < num_regs; i++) {
-        reg_file.push_back({i, -1, -1, true, true});
+        reg_file.push_back({i, -1, true, true});
     }
 
-    // Pre-allocate memory for instruction storage
-    status.reserve(instructions.size());
+    fetch_q.reset(options.fetch_q_size);
+    dispatch_q.reset(options.disp_q_size);
 
     // Resize the sched queue according to given params
     int q_size = 2 * (options.J + options.K + options.L);
     sched_q.resize(q_size);
 
+    // Issue selection masks, one bit per sched_q slot
+    sched_words = (q_size + 63) / 64;
+    pending.assign(sched_words, 0);
+    for (i = 0; i < 3; i++)
+        ready[i].assign(sched_words, 0);
+    age.assign(q_size * sched_words, 0);
+
     // Init stats
     proc_stats = {};
     proc_stats.total_instructions = instructions.size();
@@ -55,17 +137,311 @@ void Pipeline::init() {
     // Init predictor with 128 entries and 8 Smith counters per entry (3-bit GHR)
     int n = 128;
     int k = 3;
-    predictor = new BranchPredictor(n, k);
+    predictor.reset(new BranchPredictor(n, k));
+
+    if (options.mem.enabled)
+        memory.reset(new MemoryHierarchy(options.mem));
+
+    // Results fall due at most the longest latency plus a miss away
+    int span = 2;
+    for (i = 0; i < 3; i++)
+        span = std::max(span, fu_latency(i) + 1);
+    if (memory != NULL)
+        span += options.mem.l1_latency + options.mem.l2_latency + options.mem.mem_latency;
+    stages.exec.reset(span);
     mp = Misprediction::NONE;
+    mp_idx = -1;
+
+    // Memoisation doesn't model the cache, per-instruction observers or batches
+    memo = options.memo && options.converge_tol <= 0 && memory == NULL && profile == NULL && pipeview == NULL;
+
+    // Snapshots don't carry observers along
+    resumable = resumable && profile == NULL && pipeview == NULL;
+    resume.next_snapshot = 0;
+    std::fill(resume.short_at, resume.short_at + NUM_RESOURCES, UINT64_MAX);
 }
 
 void Pipeline::start() {
     init();
+    run();
+}
+
+void Pipeline::start_from(const Pipeline& base) {
+    /*
+     * Extra FUs, sched_q slots and result buses sit after the ones base
+     * has, and every search takes the first free one, so they stay unused
+     * until base finds none free: a ready entry with no FU (wake_up), a
+     * dispatched instruction with no slot (schedule) or a result with no
+     * bus (execute). Up to that cycle both runs are the same.
+     */
+    const PipelineOptions& b = base.options;
+
+    if (!base.resumable || base.cancelled || base.resume.latest == nullptr ||
+        profile != NULL || pipeview != NULL || !same_setup(options, b) ||
+        instructions.data != base.instructions.data || instructions.size() != base.instructions.size() ||
+        options.J < b.J || options.K < b.K || options.L < b.L || options.R < b.R) {
+        start();
+        return;
+    }
+
+    bool more[NUM_RESOURCES];
+    more[RES_FU0] = options.J > b.J;
+    more[RES_FU1] = options.K > b.K;
+    more[RES_FU2] = options.L > b.L;
+    more[RES_SCHED_Q] = more[RES_FU0] || more[RES_FU1] || more[RES_FU2];
+    more[RES_RB] = options.R > b.R;
+
+    int first = -1;
+
+    for (int r = 0; r < NUM_RESOURCES; r++) {
+        if (more[r] && base.resume.short_at[r] != UINT64_MAX &&
+            (first == -1 || base.resume.short_at[r] < base.resume.short_at[first]))
+            first = r;
+    }
+
+    // Never short of anything extra here: the runs are the same throughout
+    if (first == -1) {
+        status = base.status;
+        num_completed = base.num_completed;
+        proc_stats = base.proc_stats;
+        proc_stats.resumed_cycles = base.proc_stats.cycle_count;
+        clock = base.clock;
+        resume = base.resume;
+        return;
+    }
+
+    const Pipeline& snap = *base.resume.before[first];
+    PipelineOptions opt = options;
+    bool keep = resumable;
+    const std::atomic<bool>* poll = cancel;
+
+    *this = snap;
+    options = opt;
+    resumable = keep;
+    cancel = poll;
+    memo = options.memo && options.converge_tol <= 0 && memory == NULL;
+
+    grow_resources();
+    restore_status(base.status);
+
+    // Shortages before the snapshot happened here too; later ones may not
+    resume.next_snapshot = clock;
+    resume.latest = nullptr;
+
+    for (int r = 0; r < NUM_RESOURCES; r++) {
+        bool kept = base.resume.short_at[r] < clock;
+        resume.short_at[r] = kept ? base.resume.short_at[r] : UINT64_MAX;
+        resume.before[r] = kept ? base.resume.before[r] : nullptr;
+    }
+
+    proc_stats.resumed_cycles = clock;
+    run();
+}
+
+void Pipeline::take_snapshot() {
+    /*
+     * Copy the machine at this cycle boundary for start_from(). status and
+     * the front-end queues, which grow with the trace, stay out: the queues
+     * hold consecutive trace positions, recorded in resume.at, and status
+     * up to here can be recovered from the finished run. So does the memo
+     * state, which doesn't affect results.
+     */
+    InstStatus s;
+    RingQueue<InstRef> fq, dq;
+    std::unordered_map<uint64_t, uint64_t> seen;
+    std::vector<MemoCycle> log;
+    ResumeState r = {};
+    MemoMark at;
+    memo_position(at);
+
+    std::swap(status, s);
+    std::swap(fetch_q, fq);
+    std::swap(dispatch_q, dq);
+    std::swap(memo_seen, seen);
+    std::swap(memo_log, log);
+    std::swap(resume, r);
+
+    Pipeline* copy = new Pipeline(*this);
+
+    std::swap(status, s);
+    std::swap(fetch_q, fq);
+    std::swap(dispatch_q, dq);
+    std::swap(memo_seen, seen);
+    std::swap(memo_log, log);
+    std::swap(resume, r);
+
+    copy->memo_confirming = false;
+    copy->resume.at = at;
+
+    resume.latest.reset(copy);
+    resume.next_snapshot = clock + RESUME_SNAPSHOT;
+}
+
+void Pipeline::grow_resources() {
+    /*
+     * Resize a snapshot's tables to this run's options. New units go after
+     * the existing ones of their type and new slots after the existing
+     * slots, where the searches reach them last.
+     */
+    int fu_counts[] = {options.J, options.K, options.L};
+    std::vector<FU> table;
+    std::vector<int> new_id(fu_table.size());
+    int end = 0;
+
+    for (int type = 0; type < 3; type++) {
+        for (FU& fu: fu_table) {
+            if (fu.type == type) {
+                new_id[fu.id] = static_cast<int>(table.size());
+                fu.id = new_id[fu.id];
+                table.push_back(fu);
+            }
+        }
+
+        end += fu_counts[type];
+
+        for (int n = static_cast<int>(table.size()); n < end; n++) {
+            FU fu = {};
+            fu.id = n;
+            fu.type = type;
+            table.push_back(fu);
+        }
+    }
+
+    fu_table.swap(table);
+
+    for (ResultBus& rb: result_buses) {
+        if (rb.fu_id != -1)
+            rb.fu_id = new_id[rb.fu_id];
+    }
+
+    stages.exec.for_each([&new_id](uint64_t, PipelineEntry& pe) {
+        pe.fu_idx = new_id[pe.fu_idx];
+    });
+
+    for (PipelineEntry& pe: stages.exec_done)
+        pe.fu_idx = new_id[pe.fu_idx];
+
+    result_buses.resize(options.R);
+
+    // Slot masks keep their bit positions; only the age rows move
+    int old_q = static_cast<int>(sched_q.size());
+    int old_words = sched_words;
+    int q_size = 2 * (options.J + options.K + options.L);
+
+    sched_q.resize(q_size);
+    sched_words = (q_size + 63) / 64;
+    pending.resize(sched_words, 0);
+    for (int i = 0; i < 3; i++)
+        ready[i].resize(sched_words, 0);
+
+    std::vector<uint64_t> rows(q_size * sched_words, 0);
+
+    for (int i = 0; i < old_q; i++)
+        std::copy(age.begin() + i * old_words, age.begin() + (i + 1) * old_words, rows.begin() + i * sched_words);
+
+    age.swap(rows);
+}
+
+void Pipeline::restore_status(const InstStatus& full) {
+    /*
+     * Rebuild status and the front-end queues as they were at the snapshot
+     * from a finished run that passed through it. Stages follow from where
+     * each instruction is, and timestamps of stages not reached yet are
+     * cleared.
+     */
+    const MemoMark& at = resume.at;
+    size_t n = ip;
+
+    status.stage.assign(n, Stage::DONE);
+    status.fetch.assign(full.fetch.begin(), full.fetch.begin() + n);
+    status.disp.assign(full.disp.begin(), full.disp.begin() + n);
+    status.sched.assign(full.sched.begin(), full.sched.begin() + n);
+    status.exec.assign(full.exec.begin(), full.exec.begin() + n);
+    status.state.assign(full.state.begin(), full.state.begin() + n);
+    status.epochs.assign(full.epochs.begin(), std::lower_bound(full.epochs.begin(), full.epochs.end(), n));
+
+    // A dispatched branch was predicted right unless it's the mispredicted one
+    fetch_q.reset(options.fetch_q_size);
+    dispatch_q.reset(options.disp_q_size);
+
+    for (int64_t i = at.disp_head; i < at.fetch_head; i++) {
+        const Instruction& inst = instructions[i];
+        bool taken = inst.branch_addr != -1 && inst.taken;
+        dispatch_q.push_back({i, i == mp_idx ? !taken : taken});
+        status.stage[i] = Stage::DISP;
+    }
+
+    for (int64_t i = at.fetch_head; i < ip; i++) {
+        fetch_q.push_back({i, false});
+        status.stage[i] = Stage::FETCH;
+    }
+
+    for (const RS& rs: sched_q) {
+        if (!rs.empty)
+            status.stage[rs.inst_idx] = Stage::SCHED;
+    }
+
+    InstStatus& st = status;
+    stages.exec.for_each([&st](uint64_t, const PipelineEntry& pe) {
+        st.stage[pe.inst_idx] = Stage::EXEC;
+    });
+
+    for (const PipelineEntry& pe: stages.exec_done)
+        status.stage[pe.inst_idx] = Stage::EXEC;
+    for (const PipelineEntry& pe: stages.update)
+        status.stage[pe.inst_idx] = Stage::UPDATE;
+    for (const PipelineEntry& pe: stages.retire)
+        status.stage[pe.inst_idx] = Stage::DONE;
+
+    for (int64_t i = at.lo; i < ip; i++) {
+        Stage s = status.stage[i];
+
+        if (s < Stage::DISP)
+            status.disp[i] = 0;
+        if (s < Stage::SCHED)
+            status.sched[i] = 0;
+        if (s < Stage::EXEC)
+            status.exec[i] = 0;
+        if (s < Stage::UPDATE)
+            status.state[i] = 0;
+    }
+}
+
+void Pipeline::advance(uint64_t completed) {
+    if (!started)
+        init();
+
+    if (!ended())
+        loop(completed);
+}
+
+void Pipeline::run() {
+    loop(UINT64_MAX);
+    finish();
+}
+
+void Pipeline::loop(uint64_t completed) {
+    pause_at = std::min<uint64_t>(completed, instructions.size());
+
+    // Pre-allocate instruction storage once the run is going to the end;
+    // a run paused at a prefix (advance()) grows it as it goes
+    if (pause_at == instructions.size())
+        status.reserve(instructions.size());
 
     // Pipeline loop (single cycle per iteration)
-    while (num_completed < instructions.size()) {
+    while (num_completed < pause_at) {
+        // Poll for cancellation now and then; the check isn't free
+        if (cancel != NULL && (clock & 1023) == 0 && cancel->load(std::memory_order_relaxed)) {
+            cancelled = true;
+            break;
+        }
+
+        if (resumable && clock >= resume.next_snapshot)
+            take_snapshot();
+
         // Retire any completed instructions (remove from schedq)
-        proc_stats.avg_inst_retired += retire();
+        int retired = retire();
+        proc_stats.avg_inst_retired += retired;
 
         // Check result buses for broadcasts
         check_buses();
@@ -77,7 +453,7 @@ void Pipeline::start() {
         execute();
 
         // Mark independent inst. in sched queue for firing
-        wake_up();
+        account_cycle(wake_up());
 
         // Move from dispatch to RS in schedq
         schedule();
@@ -86,7 +462,8 @@ void Pipeline::start() {
         dispatch();
 
         // Fetch inst. into dispatch queue (if instructions available!)
-        ip += fetch();
+        int fetched = fetch();
+        ip += fetched;
 
         // Record dispatch queue size
         if (dispatch_q.size() > proc_stats.max_disp_size)
@@ -95,10 +472,28 @@ void Pipeline::start() {
         proc_stats.avg_disp_size += dispatch_q.size();
 
         clock++;
+
+        if (memo) {
+            memo_cycle.fetched = fetched;
+            memo_cycle.retired = retired;
+            memo_cycle.disp_size = dispatch_q.size();
+            memo_step();
+        }
+
+        if (options.converge_tol > 0 && clock % CONVERGE_BATCH == 0 && check_convergence())
+            break;
     }
+}
 
+void Pipeline::finish() {
     clock -= 2;
 
+    proc_stats.simulated_instructions = num_completed;
+
+    // Stopped early: only what retired so far was issued and counted
+    if (num_completed < instructions.size())
+        proc_stats.avg_inst_issue = static_cast<double>(num_completed);
+
     // Collect stats
     proc_stats.cycle_count = clock;
     proc_stats.avg_disp_size /= clock;
@@ -106,32 +501,480 @@ void Pipeline::start() {
     proc_stats.avg_inst_retired /= clock;
     proc_stats.prediction_accuracy = static_cast<double>(proc_stats.correct_branches) / proc_stats.total_branches;
 
+    // Report the batch-means estimate, which leaves out the warmup batch
+    if (proc_stats.converged)
+        proc_stats.avg_inst_retired = batch_sum / num_batches;
+
+    for (int c = 0; c < NUM_STALL_CAUSES; c++)
+        proc_stats.cpi_stack[c] = proc_stats.stall_cycles[c] / num_completed;
+
+    if (memory != NULL) {
+        proc_stats.l1_hits = memory->l1.hits;
+        proc_stats.l1_misses = memory->l1.misses;
+        proc_stats.l2_hits = memory->l2.hits;
+        proc_stats.l2_misses = memory->l2.misses;
+    }
+
     // Cleanup
-    delete predictor;
+    predictor.reset();
+    memory.reset();
+}
+
+bool Pipeline::check_convergence() {
+    /*
+     * Close a batch of CONVERGE_BATCH cycles and test whether the batch
+     * means pin down IPC tightly enough. Returns true to stop the run.
+     */
+    double ipc = static_cast<double>(num_completed - batch_start_completed) / CONVERGE_BATCH;
+    batch_start_completed = num_completed;
+
+    if (clock / CONVERGE_BATCH <= CONVERGE_WARMUP)
+        return false;
+
+    num_batches++;
+    batch_sum += ipc;
+    batch_sum_sq += ipc * ipc;
+
+    if (num_batches < CONVERGE_MIN_BATCHES)
+        return false;
+
+    double n = static_cast<double>(num_batches);
+    double mean = batch_sum / n;
+    double var = std::max(0.0, (batch_sum_sq - n * mean * mean) / (n - 1));
+    double half_width = 1.96 * std::sqrt(var / n);
+
+    proc_stats.ipc_error = half_width;
+
+    if (mean > 0 && half_width <= options.converge_tol * mean) {
+        proc_stats.converged = true;
+        return true;
+    }
+
+    return false;
+}
+
+void Pipeline::memo_position(MemoMark& mark) {
+    // dispatch_q and fetch_q hold consecutive trace positions, in that order
+    mark.fetch_head = fetch_q.empty() ? ip : fetch_q.front().idx;
+    mark.disp_head = mark.fetch_head - static_cast<int64_t>(dispatch_q.size());
+    mark.lo = mark.disp_head;
+
+    for (const RS& rs: sched_q) {
+        if (!rs.empty)
+            mark.lo = std::min(mark.lo, rs.inst_idx);
+    }
+
+    mark.clock = clock;
+    mark.completed = num_completed;
+    mark.branches = proc_stats.total_branches;
+    mark.correct_branches = proc_stats.correct_branches;
+    mark.tag = curr_tag;
+}
+
+void Pipeline::memo_state(std::vector<int64_t>& key, int64_t disp_head) {
+    /*
+     * Describe everything that decides what the machine does next, with
+     * trace positions relative to the dispatch_q head, tags relative to the
+     * next tag and cycles relative to the clock, so that iterations of a
+     * loop compare equal. Tags of operands that are already ready and the
+     * contents of idle slots are never looked at again, so they're left out.
+     *
+     * An unbounded fetch_q always holds at least F instructions at dispatch
+     * until the trace runs out, so only its head matters. An unbounded
+     * dispatch_q of sched_q size or more looks the same to schedule()
+     * whatever its length, as long as no misprediction makes dispatch wait
+     * for the back end. Bounded queues apply backpressure, so their exact
+     * lengths count.
+     */
+    const int64_t NA = INT64_MIN;
+    size_t q_size = sched_q.size();
+    bool long_q = options.disp_q_size == 0 && dispatch_q.size() >= q_size && mp == Misprediction::NONE;
+
+    key.clear();
+    key.push_back(mp);
+    key.push_back(long_q ? -1 : static_cast<int64_t>(dispatch_q.size()));
+    key.push_back(options.fetch_q_size == 0 ? -1 : static_cast<int64_t>(fetch_q.size()));
+    key.push_back(schedq_size);
+
+    for (const RS& rs: sched_q) {
+        if (rs.empty) {
+            key.push_back(NA);
+            continue;
+        }
+
+        key.push_back(rs.inst_idx - disp_head);
+        key.push_back(rs.fu_type);
+        key.push_back(rs.dest_reg);
+        key.push_back(rs.dest_tag - curr_tag);
+        key.push_back(rs.src1_ready ? NA : rs.src1_tag - curr_tag);
+        key.push_back(rs.src2_ready ? NA : rs.src2_tag - curr_tag);
+    }
+
+    for (int w = 0; w < sched_words; w++) {
+        key.push_back(static_cast<int64_t>(pending[w]));
+        key.push_back(static_cast<int64_t>(ready[0][w] | ready[1][w] | ready[2][w]));
+    }
+
+    // Age order only matters among entries still waiting for issue
+    for (size_t i = 0; i < q_size; i++) {
+        if (!(pending[i >> 6] & (1ULL << (i & 63))))
+            continue;
+
+        for (int w = 0; w < sched_words; w++)
+            key.push_back(static_cast<int64_t>(age[i * sched_words + w] & pending[w]));
+    }
+
+    // What each unit holds is in the exec entries
+    for (const FU& fu: fu_table)
+        key.push_back(fu.in_flight);
+
+    for (const ResultBus& rb: result_buses) {
+        if (!rb.busy) {
+            key.push_back(NA);
+            continue;
+        }
+
+        key.push_back(rb.inst_idx - disp_head);
+        key.push_back(rb.tag - curr_tag);
+        key.push_back(rb.reg_no);
+    }
+
+    for (const Register& reg: reg_file)
+        key.push_back(reg.ready ? NA : reg.tag - curr_tag);
+
+    // The wheel's slot order depends on the clock, so list what's in
+    // flight by due cycle instead
+    std::vector<std::pair<uint64_t, PipelineEntry>> in_flight;
+    stages.exec.for_each([&in_flight](uint64_t due, const PipelineEntry& pe) {
+        in_flight.push_back(std::make_pair(due, pe));
+    });
+
+    std::sort(in_flight.begin(), in_flight.end(), [](const std::pair<uint64_t, PipelineEntry>& a,
+                                                     const std::pair<uint64_t, PipelineEntry>& b) {
+        return a.first != b.first ? a.first < b.first : a.second.tag < b.second.tag;
+    });
+
+    std::vector<PipelineEntry> exec;
+    for (const std::pair<uint64_t, PipelineEntry>& e: in_flight) {
+        key.push_back(static_cast<int64_t>(e.first - clock));
+        exec.push_back(e.second);
+    }
+
+    std::vector<PipelineEntry> update(stages.update.begin(), stages.update.end());
+    std::vector<PipelineEntry> retire(stages.retire.begin(), stages.retire.end());
+    const std::vector<PipelineEntry>* lists[] = {&exec, &stages.exec_done, &update, &retire};
+
+    for (const std::vector<PipelineEntry>* l: lists) {
+        key.push_back(static_cast<int64_t>(l->size()));
+
+        for (const PipelineEntry& pe: *l) {
+            key.push_back(pe.inst_idx - disp_head);
+            key.push_back(pe.tag - curr_tag);
+            key.push_back(static_cast<int64_t>(pe.cycle - clock));
+            key.push_back(pe.rs_idx);
+            key.push_back(pe.fu_idx);
+        }
+    }
+
+    predictor->snapshot(key);
+}
+
+uint64_t Pipeline::memo_periodic(int64_t start, int64_t from, int64_t step, uint64_t k) {
+    /*
+     * Returns how many whole steps past trace position `from` (at most k)
+     * the trace keeps repeating itself with period `step`, checking every
+     * position from `start` on against the one a period earlier.
+     */
+    size_t end = from + k * step;
+    size_t x = start;
+
+    while (x < end && same_inst(instructions[x], instructions[x - step]))
+        x++;
+
+    if (x < static_cast<size_t>(from))
+        return 0;
+
+    return (x - from) / step;
+}
+
+void Pipeline::memo_step() {
+    /*
+     * Runs at each cycle boundary. Every MEMO_PROBE cycles the machine
+     * state is hashed, and when a hash comes back the cycles since are a
+     * candidate loop period. The next period is simulated as usual and
+     * logged; memo_replay() then checks it and skips ahead.
+     */
+    if (memo_confirming) {
+        memo_log.push_back(memo_cycle);
+
+        if (clock - memo_mark.clock == memo_period) {
+            memo_confirming = false;
+            memo_replay();
+        }
+
+        return;
+    }
+
+    if (clock % MEMO_PROBE != 0)
+        return;
+
+    MemoMark mark;
+    memo_position(mark);
+    memo_state(memo_key, mark.disp_head);
+
+    // FNV-1a over the state words
+    uint64_t hash = 14695981039346656037ULL;
+    for (int64_t v: memo_key)
+        hash = (hash ^ static_cast<uint64_t>(v)) * 1099511628211ULL;
+
+    std::unordered_map<uint64_t, uint64_t>::iterator it = memo_seen.find(hash);
+
+    if (it != memo_seen.end() && clock - it->second <= MEMO_MAX_PERIOD) {
+        memo_period = clock - it->second;
+        memo_mark = mark;
+        memo_log.clear();
+        memo_confirming = true;
+    }
+
+    if (memo_seen.size() >= MEMO_MAX_SEEN)
+        memo_seen.clear();
+
+    memo_seen[hash] = clock;
+}
+
+void Pipeline::memo_replay() {
+    /*
+     * The period logged since memo_mark ended in the state it started in.
+     * With the trace repeating too, every following period plays out the
+     * same way, shifted by D trace positions in the back end, Db in the
+     * front end and T tags, so replay k of them from the log: the stats
+     * from the per-cycle log, the timestamps from the last period's.
+     * With a growing dispatch_q the two ends drift apart (Db > D); that's
+     * only safe with no mispredictions and the queue long enough throughout.
+     */
+    const MemoMark& m0 = memo_mark;
+    MemoMark now;
+    memo_position(now);
+
+    std::vector<int64_t> key;
+    memo_state(key, now.disp_head);
+
+    if (key != memo_key)
+        return;
+
+    uint64_t P = memo_period;
+    int64_t D = now.disp_head - m0.disp_head;
+    int64_t Db = now.fetch_head - m0.fetch_head;
+    int64_t T = curr_tag - m0.tag;
+    int64_t g = Db - D; // dispatch_q growth per period
+
+    if (D <= 0 || g < 0)
+        return;
+
+    if (g > 0) {
+        if (proc_stats.total_branches - m0.branches != proc_stats.correct_branches - m0.correct_branches)
+            return;
+
+        for (const MemoCycle& c: memo_log) {
+            if (c.disp_size < sched_q.size())
+                return;
+        }
+    }
+
+    // Dispatch must find F instructions in fetch_q to the end (a bounded
+    // fetch_q must be refilled just as before), and the instructions both
+    // ends work on must keep repeating
+    int64_t room = static_cast<int64_t>(instructions.size()) - options.F - (options.fetch_q_size == 0 ? now.fetch_head : ip);
+    if (room < Db)
+        return;
+
+    uint64_t k = room / Db;
+
+    // Don't replay past where a prefix run pauses
+    uint64_t per_period = num_completed - m0.completed;
+    if (pause_at < instructions.size() && per_period > 0)
+        k = std::min<uint64_t>(k, pause_at > num_completed ? (pause_at - num_completed) / per_period : 0);
+
+    k = memo_periodic(m0.lo + D, now.disp_head, D, k);
+    k = memo_periodic(m0.fetch_head + Db, now.fetch_head, Db, k);
+
+    if (k == 0)
+        return;
+
+    // An unbounded fetch runs F a cycle regardless of the back end; a
+    // bounded one fetches what it did in the logged period
+    uint64_t end_clock = clock + k * P;
+    int64_t n = static_cast<int64_t>(instructions.size());
+    int64_t old_ip = ip;
+
+    for (uint64_t t = clock; t < end_clock && ip < n; t++) {
+        int count = options.fetch_q_size == 0 ? options.F : memo_log[(t - clock) % P].fetched;
+
+        for (int64_t i = ip; i < ip + count && i < n; i++)
+            status.push_back(t);
+
+        ip = std::min(ip + count, n);
+    }
+
+    // Timestamps: repeat the last period's, one period further each time.
+    // They hold the low 32 bits of the cycle, so whether a stage was
+    // reached comes from the instruction's stage and the period's cycles
+    // are picked out modulo 2^32.
+    std::vector<uint32_t>* back[] = {&status.sched, &status.exec, &status.state};
+    Stage reached[] = {Stage::SCHED, Stage::EXEC, Stage::UPDATE};
+    std::vector<std::pair<int64_t, uint32_t>> events;
+    uint32_t start = static_cast<uint32_t>(m0.clock);
+
+    for (int f = 0; f < 3; f++) {
+        std::vector<uint32_t>* field = back[f];
+        events.clear();
+
+        for (int64_t i = m0.lo; i < now.disp_head; i++) {
+            Stage s = status.stage[i];
+            uint32_t t = (*field)[i];
+
+            if (s >= reached[f] && static_cast<uint32_t>(t - start) < P)
+                events.push_back(std::make_pair(i, t));
+        }
+
+        for (uint64_t m = 1; m <= k; m++) {
+            for (const std::pair<int64_t, uint32_t>& e: events)
+                (*field)[e.first + m * D] = static_cast<uint32_t>(e.second + m * P);
+        }
+    }
+
+    for (uint64_t m = 1; m <= k; m++) {
+        for (int64_t i = m0.fetch_head; i < now.fetch_head; i++)
+            status.disp[i + m * Db] = static_cast<uint32_t>(status.disp[i] + m * P);
+    }
+
+    // Stages: the back end window moves along, everything it passed is done
+    int64_t shift = static_cast<int64_t>(k) * D;
+    int64_t disp_head = now.disp_head + shift;
+    int64_t fetch_head = now.fetch_head + static_cast<int64_t>(k) * Db;
+
+    for (int64_t i = now.disp_head - 1; i >= now.lo; i--)
+        status.stage[i + shift] = status.stage[i];
+    std::fill(status.stage.begin() + now.lo, status.stage.begin() + now.lo + shift, Stage::DONE);
+    std::fill(status.stage.begin() + disp_head, status.stage.begin() + fetch_head, Stage::DISP);
+
+    // Machine state: same as now, shifted
+    int64_t tag_shift = static_cast<int64_t>(k) * T;
+
+    for (RS& rs: sched_q) {
+        if (rs.empty)
+            continue;
+
+        rs.inst_idx += shift;
+        rs.dest_tag += tag_shift;
+
+        if (rs.src1_tag != -1)
+            rs.src1_tag += tag_shift;
+        if (rs.src2_tag != -1)
+            rs.src2_tag += tag_shift;
+    }
+
+    for (ResultBus& rb: result_buses) {
+        if (rb.busy) {
+            rb.inst_idx += shift;
+            rb.tag += tag_shift;
+        }
+    }
+
+    for (Register& reg: reg_file) {
+        if (!reg.ready)
+            reg.tag += tag_shift;
+    }
+
+    auto move_entry = [shift, tag_shift, k, P](PipelineEntry& pe) {
+        pe.inst_idx += shift;
+        pe.tag += tag_shift;
+        pe.cycle += k * P;
+    };
+
+    // Entries in flight fall due k periods later, in other wheel slots
+    std::vector<std::pair<uint64_t, PipelineEntry>> in_flight;
+    stages.exec.drain(in_flight);
+
+    for (std::pair<uint64_t, PipelineEntry>& e: in_flight) {
+        move_entry(e.second);
+        stages.exec.push(e.first + k * P, e.second);
+    }
+
+    std::for_each(stages.exec_done.begin(), stages.exec_done.end(), move_entry);
+    std::for_each(stages.update.begin(), stages.update.end(), move_entry);
+    std::for_each(stages.retire.begin(), stages.retire.end(), move_entry);
+
+    if (mp != Misprediction::NONE)
+        mp_idx = fetch_head - 1;
+
+    // A steady dispatch_q keeps its predictions, shifted; a growing one saw
+    // no mispredictions, so every branch was predicted as it went
+    if (g == 0) {
+        for (size_t i = 0; i < dispatch_q.size(); i++)
+            dispatch_q[i].idx += shift;
+    } else {
+        dispatch_q.clear();
+
+        for (int64_t i = disp_head; i < fetch_head; i++)
+            dispatch_q.push_back({i, instructions[i].branch_addr != -1 && instructions[i].taken});
+    }
+
+    while (!fetch_q.empty() && fetch_q.front().idx < fetch_head)
+        fetch_q.pop_front();
+
+    for (int64_t i = std::max(old_ip, fetch_head); i < ip; i++)
+        fetch_q.push_back({i, false});
+
+    // Stats, cycle by cycle so sums round exactly as they would have
+    for (uint64_t m = 1; m <= k; m++) {
+        for (const MemoCycle& c: memo_log) {
+            proc_stats.avg_inst_retired += c.retired;
+            proc_stats.stall_cycles[StallCause::BASE] += c.used;
+
+            if (c.cause != NUM_STALL_CAUSES)
+                proc_stats.stall_cycles[c.cause] += 1.0 - c.used;
+
+            uint64_t disp_size = c.disp_size + m * g;
+            if (disp_size > proc_stats.max_disp_size)
+                proc_stats.max_disp_size = disp_size;
+
+            proc_stats.avg_disp_size += disp_size;
+        }
+    }
+
+    num_completed += k * (num_completed - m0.completed);
+    proc_stats.total_branches += k * (proc_stats.total_branches - m0.branches);
+    proc_stats.correct_branches += k * (proc_stats.correct_branches - m0.correct_branches);
+    proc_stats.memo_cycles += k * P;
+    curr_tag += tag_shift;
+    clock = end_clock;
+
+    // Old probes now lie across the skipped stretch
+    memo_seen.clear();
 }
 
 int Pipeline::fetch() {
     /*
      * Fetch F instructions in dispatch queue every cycle.
-     * Stop if all instructions have been fetched.
+     * Stop if all instructions have been fetched, or fetch_q is full.
      */
     int count = 0;
 
-    for (int i = ip; i < (ip + options.F) && i < instructions.size(); i++) {
-        // Insert instruction into dispatch queue
-        Instruction& inst = instructions[i];
-        inst.idx = i;
-        inst.ip = i;
+    // Grow status ahead of fetch, but never past the end of the trace
+    if (status.size() + options.F > status.stage.capacity() && status.stage.capacity() < instructions.size())
+        status.reserve(std::min(2 * status.size() + options.F, instructions.size()));
 
-        // Create a InstStatus entry to track instruction progress
-        InstStatus is = {};
-        is.idx = inst.idx;
-        is.fetch = clock;
-        is.stage = Stage::FETCH;
-        is.inst = i;
+    for (int64_t i = ip; i < (ip + options.F) && i < static_cast<int64_t>(instructions.size()) && !fetch_q.full(); i++) {
+        // Create a status entry to track instruction progress
+        status.push_back(clock);
 
-        status.push_back(is);
-        fetch_q.push_back(inst);
+        if (pipeview != NULL)
+            pipeview->record(clock, i, PV_FETCH);
+
+        // Insert instruction into fetch queue; the trace is shared between
+        // runs, so only its position is queued
+        fetch_q.push_back({i, false});
 
         count++;
     }
@@ -143,30 +986,45 @@ void Pipeline::dispatch() {
     int dispatched = 0;
     int i;
 
-    for (i = 0; i < fetch_q.size() && i < options.F; i++) {
+    for (i = 0; i < static_cast<int>(fetch_q.size()) && i < options.F; i++) {
         // Stop dispatch if currently mispredicting
         if (mp != Misprediction::NONE)
             break;
 
-        Instruction& inst = fetch_q[i];
-        InstStatus& is = status[inst.idx];
+        // Backpressure from a bounded dispatch_q
+        if (dispatch_q.full())
+            break;
+
+        InstRef& ref = fetch_q[i];
+        const Instruction& inst = instructions[ref.idx];
 
-        is.disp = clock;
-        is.stage = Stage::DISP;
+        status.disp[ref.idx] = clock;
+        status.stage[ref.idx] = Stage::DISP;
+
+        if (pipeview != NULL)
+            pipeview->record(clock, ref.idx, PV_DISP);
 
         // Check branch behavior; stall if it's branch and currently not mispredicting
         if (inst.branch_addr != -1) {
-            bool prediction = predictor->predict(inst.addr);
+            bool prediction = predictor->predict(static_cast<uint64_t>(inst.addr));
 
             // Store prediction with inst.
-            inst.p_taken = prediction;
-            instructions[inst.idx].p_taken = prediction;
+            ref.p_taken = prediction;
 
-            if (inst.taken != inst.p_taken) {
-                if (inst.p_taken)
+            if (inst.taken != ref.p_taken) {
+                if (ref.p_taken)
                     mp = Misprediction::TAKEN;
                 else
                     mp = Misprediction::NOT_TAKEN;
+
+                // Dispatch stops here, so this is the only mispredicted branch in flight
+                mp_idx = ref.idx;
+
+                if (profile != NULL)
+                    profile->record_mispredict(inst.addr);
+
+                if (pipeview != NULL)
+                    pipeview->record(clock, ref.idx, PV_MISPREDICT);
             } else {
                 proc_stats.correct_branches++;
             }
@@ -174,7 +1032,7 @@ void Pipeline::dispatch() {
             proc_stats.total_branches++;
         }
 
-        dispatch_q.push_back(inst);
+        dispatch_q.push_back(ref);
 
         dispatched++;
     }
@@ -184,19 +1042,19 @@ void Pipeline::dispatch() {
         fetch_q.pop_front();
 }
 
-void Pipeline::schedq_insert(Instruction& inst, RS& rs) {
+void Pipeline::schedq_insert(const Instruction& inst, int64_t idx, RS& rs) {
     /* Insert an Instruction into the schedQ */
     rs.fu_type = inst.fu_type;
     rs.dest_reg = inst.dest_reg;
-    rs.inst_idx = inst.idx;
+    rs.inst_idx = idx;
 
     int src1 = inst.src_reg[0];
     int src2 = inst.src_reg[1];
 
     if (src1 != -1) {
         if (reg_file[src1].ready) {
-            rs.src1_value = reg_file[src1].value;
             rs.src1_ready = true;
+            rs.src1_tag = -1;
         } else {
             rs.src1_tag = reg_file[src1].tag;
             rs.src1_ready = false;
@@ -209,8 +1067,8 @@ void Pipeline::schedq_insert(Instruction& inst, RS& rs) {
 
     if (src2 != -1) {
         if (reg_file[src2].ready) {
-            rs.src2_value = reg_file[src2].value;
             rs.src2_ready = true;
+            rs.src2_tag = -1;
         } else {
             rs.src2_tag = reg_file[src2].tag;
             rs.src2_ready = false;
@@ -229,20 +1087,22 @@ void Pipeline::schedule() {
     int scheduled = 0;
 
     // Otherwise, find a suitable RS
-    for (i = 0; i < dispatch_q.size(); i++) {
+    for (i = 0; i < static_cast<int>(dispatch_q.size()); i++) {
         // Schedq full, stop looking
-        if (schedq_size == sched_q.size())
+        if (schedq_size == static_cast<int>(sched_q.size())) {
+            note_short(RES_SCHED_Q);
             break;
+        }
 
-        Instruction& inst = dispatch_q[i];
-        InstStatus& is = status[inst.idx];
+        int64_t idx = dispatch_q[i].idx;
+        const Instruction& inst = instructions[idx];
 
         rs_idx = 0;
 
         for (RS& rs: sched_q) {
             // Add instruction to first free slot in schedQ
             if (rs.empty) {
-                schedq_insert(inst, rs);
+                schedq_insert(inst, idx, rs);
                 schedq_size++;
 
                 // Always generate a new tag for dest, even if -1!
@@ -255,18 +1115,15 @@ void Pipeline::schedule() {
                 }
 
                 // Add to SCHED stage
-                is.sched = clock;
-                is.stage = Stage::SCHED;
+                status.sched[idx] = clock;
+                status.stage[idx] = Stage::SCHED;
 
-                // Create pipeline entry and add to pipeline
-                PipelineEntry pe = {};
-                pe.inst_idx = inst.idx;
-                pe.rs_idx = rs_idx;
-                pe.cycle = clock;
-                pe.tag = rs.dest_tag;
-                pe.dummy = is.dummy;
+                if (pipeview != NULL)
+                    pipeview->record(clock, idx, PV_SCHED, rs_idx);
 
-                stages.sched.push_back(pe);
+                // Now the youngest entry waiting for issue
+                sched_track(rs_idx);
+                sched_update_ready(rs_idx);
 
                 scheduled++;
 
@@ -282,14 +1139,14 @@ void Pipeline::schedule() {
         dispatch_q.pop_front();
 }
 
-int Pipeline::rb_find_tag(int tag) {
+int Pipeline::rb_find_tag(int64_t tag) {
     /*
      * Find if particular tag is one a result bus
      * If so, return index of RB; otherwise, -1
      */
     ResultBus rb;
 
-    for (int i = 0; i < result_buses.size(); i++) {
+    for (int i = 0; i < static_cast<int>(result_buses.size()); i++) {
         rb = result_buses[i];
         if (rb.busy && rb.tag == tag)
             return i;
@@ -299,15 +1156,19 @@ int Pipeline::rb_find_tag(int tag) {
 }
 
 void Pipeline::check_buses() {
+    int rs_idx = 0;
+
     for (RS& rs: sched_q) {
         // Skip empty entries
-        if (rs.empty)
+        if (rs.empty) {
+            rs_idx++;
             continue;
+        }
 
-        int tags[] = {rs.src1_tag, rs.src2_tag};
+        int64_t tags[] = {rs.src1_tag, rs.src2_tag};
         int i = 0;
 
-        for (int tag: tags) {
+        for (int64_t tag: tags) {
             // Check for a broadcast on a result bus for this tag
             if (tag != -1) {
                 // Find idx of the ResultBus
@@ -315,21 +1176,20 @@ void Pipeline::check_buses() {
 
                 // Broadcast found
                 if (rb_idx != -1) {
-                    ResultBus& rb = result_buses[rb_idx];
-
-                    // Update RS with result from bus
-                    if (i == 0) {
+                    // Mark RS operand as ready
+                    if (i == 0)
                         rs.src1_ready = true;
-                        rs.src1_value = rb.value;
-                    } else {
+                    else
                         rs.src2_ready = true;
-                        rs.src2_value = rb.value;
-                    }
+
+                    sched_update_ready(rs_idx);
                 }
             }
 
             i++;
         }
+
+        rs_idx++;
     }
 }
 
@@ -337,94 +1197,222 @@ int Pipeline::find_fu(int type) {
     // Returns a free FU of a given type, -1 if not found
     if (type == -1) type = 1;
 
+    // A pipelined unit takes one instruction a cycle, up to latency deep
+    int depth = options.pipelined[type] ? fu_latency(type) : 1;
+
     for (FU& fu: fu_table) {
-        if (fu.type == type && !fu.busy)
+        if (fu.type == type && fu.in_flight < depth && fu.last_issue != clock)
             return fu.id;
     }
 
     return -1;
 }
 
-void Pipeline::wake_up() {
-    std::vector<PipelineEntry> sorted;
-    sort_stage(sorted, Stage::SCHED);
+void Pipeline::sched_track(int rs_idx) {
+    /*
+     * Record the age of a newly inserted sched_q entry: every entry still
+     * waiting for issue is older than it. Clear the slot's column first so
+     * rows don't keep age bits from its previous occupant.
+     */
+    int w = rs_idx >> 6;
+    uint64_t bit = 1ULL << (rs_idx & 63);
 
-    for (PipelineEntry& pe: sorted) {
-        RS& rs = sched_q[pe.rs_idx];
+    for (int i = 0; i < static_cast<int>(sched_q.size()); i++)
+        age[i * sched_words + w] &= ~bit;
+
+    std::copy(pending.begin(), pending.end(), age.begin() + rs_idx * sched_words);
+    bit_set(pending, rs_idx);
+}
 
-        if (rs.src1_ready && rs.src2_ready) {
-            int fu_type = rs.fu_type;
-            int fu_idx = find_fu(fu_type);
+void Pipeline::sched_update_ready(int rs_idx) {
+    // Entry becomes selectable once it is waiting and both operands are ready
+    RS& rs = sched_q[rs_idx];
+    int w = rs_idx >> 6;
+    uint64_t bit = 1ULL << (rs_idx & 63);
 
-            // Found a free FU of the given type
-            if (fu_idx != -1) {
-                // Issue the instruction
-                FU& fu = fu_table[fu_idx];
-                fu.inst_idx = rs.inst_idx;
-                fu.dest = rs.dest_reg;
-                fu.tag = rs.dest_tag;
-                fu.busy = true;
+    if ((pending[w] & bit) && rs.src1_ready && rs.src2_ready)
+        bit_set(ready[issue_type(rs.fu_type)], rs_idx);
+}
 
-                // Advance to EXEC stage
-                InstStatus& is = status[pe.inst_idx];
-                is.exec = clock;
-                is.stage = Stage::EXEC;
+int Pipeline::sched_select(int type) {
+    /*
+     * Returns the oldest ready sched_q slot for a FU type, -1 if none.
+     * The oldest is the ready entry with no ready entries older than it.
+     */
+    std::vector<uint64_t>& r = ready[type];
 
-                pe.cycle = clock;
-                stages.exec.push_back(pe);
+    for (int w = 0; w < sched_words; w++) {
+        uint64_t bits = r[w];
+
+        while (bits) {
+            int i = (w << 6) + __builtin_ctzll(bits);
+            bits &= bits - 1;
 
-                // Remove from SCHED stage
-                stages.sched.remove_if([pe](PipelineEntry p1) {
-                    return pe.inst_idx == p1.inst_idx;
-                });
+            const uint64_t* row = &age[i * sched_words];
+            bool oldest = true;
+
+            for (int v = 0; v < sched_words; v++) {
+                if (row[v] & r[v]) {
+                    oldest = false;
+                    break;
+                }
             }
+
+            if (oldest)
+                return i;
         }
     }
+
+    return -1;
 }
 
-int Pipeline::find_fu_by_tag(int tag) {
-    for (FU& fu: fu_table) {
-        if (fu.tag == tag)
-            return fu.id;
+int Pipeline::wake_up() {
+    /*
+     * Issue the oldest ready entries of each FU type to free FUs.
+     * FU types don't compete with each other, so each is selected separately.
+     * Returns the number of instructions issued.
+     */
+    int issued = 0;
+
+    for (int type = 0; type < 3; type++) {
+        while (true) {
+            int rs_idx = sched_select(type);
+            if (rs_idx == -1)
+                break;
+
+            int fu_idx = find_fu(type);
+            if (fu_idx == -1) {
+                note_short(static_cast<Resource>(RES_FU0 + type));
+                break;
+            }
+
+            // Issue the instruction
+            RS& rs = sched_q[rs_idx];
+            FU& fu = fu_table[fu_idx];
+            fu.in_flight++;
+            fu.last_issue = clock;
+
+            bit_clear(pending, rs_idx);
+            bit_clear(ready[type], rs_idx);
+
+            // Advance to EXEC stage
+            status.exec[rs.inst_idx] = clock;
+            status.stage[rs.inst_idx] = Stage::EXEC;
+
+            if (pipeview != NULL)
+                pipeview->record(clock, rs.inst_idx, PV_EXEC, fu_idx);
+
+            // pe.cycle is when execute() can put the result on a bus: an
+            // L-cycle unit delivers it L cycles after issue
+            PipelineEntry pe = {};
+            pe.inst_idx = rs.inst_idx;
+            pe.rs_idx = rs_idx;
+            pe.fu_idx = fu_idx;
+            pe.cycle = clock + fu_latency(type);
+            pe.tag = rs.dest_tag;
+
+            // Cache accesses hold the FU and delay the result by their full
+            // latency; execute() picks the entry up when done
+            if (memory != NULL)
+                pe.cycle += memory->access(static_cast<uint64_t>(instructions[rs.inst_idx].addr));
+
+            stages.exec.push(pe.cycle, pe);
+            issued++;
+        }
     }
 
-    return -1;
+    return issued;
 }
 
-void Pipeline::sort_stage(std::vector<PipelineEntry>& l, Stage s) {
-    std::list<PipelineEntry>* stage;
+void Pipeline::account_cycle(int issued) {
+    /*
+     * The machine can issue F instructions per cycle. The issued share of
+     * the cycle is BASE; the rest goes to the one cause that best explains
+     * why nothing more issued, checked from the back end forward.
+     * The first two cycles (fetch and dispatch of the first group) aren't
+     * part of the reported cycle count, so they're skipped here too.
+     */
+    if (clock < 2)
+        return;
+
+    double used = std::min(issued, options.F) / static_cast<double>(options.F);
+    proc_stats.stall_cycles[StallCause::BASE] += used;
 
-    if (s == Stage::SCHED)
-        stage = &stages.sched;
-    else if (s == Stage::EXEC)
-        stage = &stages.exec;
-    else if (s == Stage::UPDATE)
-        stage = &stages.update;
-    else
+    memo_cycle.used = used;
+    memo_cycle.cause = NUM_STALL_CAUSES;
+
+    if (used == 1.0)
         return;
 
-    for (PipelineEntry& pe: *stage) {
-        if (clock >= pe.cycle)
-            l.push_back(pe);
+    StallCause cause;
+    bool any_ready = false, any_pending = false;
+
+    for (int w = 0; w < sched_words; w++) {
+        any_ready |= (ready[0][w] | ready[1][w] | ready[2][w]) != 0;
+        any_pending |= pending[w] != 0;
     }
 
-    if (!l.empty()) {
-        std::sort(l.begin(), l.end(), [](const PipelineEntry& p1, const PipelineEntry& p2) {
-            if (p1.cycle == p2.cycle)
-                return p1.tag < p2.tag;
-            else
-                return p1.cycle < p2.cycle;
+    bool schedq_full = schedq_size == static_cast<int>(sched_q.size());
+
+    // Issued instructions still serving a cache miss
+    bool mem_wait = false;
+
+    if (memory != NULL) {
+        const TraceView& trace = instructions;
+        const Pipeline* self = this;
+        uint64_t now = clock;
+
+        stages.exec.for_each([&](uint64_t, const PipelineEntry& pe) {
+            int lat = self->fu_latency(issue_type(trace[pe.inst_idx].fu_type));
+            mem_wait |= pe.cycle - lat > now;
         });
     }
+
+    // A full sched_q with work queued behind it is charged to the queue size,
+    // since a larger window could have found something independent to issue
+    if (any_ready)
+        cause = mem_wait ? StallCause::MEMORY : StallCause::FU_BUSY;
+    else if (any_pending && rb_stall)
+        cause = StallCause::RESULT_BUS;
+    else if (any_pending && mem_wait)
+        cause = StallCause::MEMORY;
+    else if (schedq_full && !dispatch_q.empty())
+        cause = StallCause::SCHED_FULL;
+    else if (any_pending)
+        cause = StallCause::DEPENDENCY;
+    else if (dispatch_q.empty() && mp != Misprediction::NONE)
+        cause = StallCause::MISPREDICT;
+    else if (dispatch_q.empty() && fetch_q.empty() && ip >= static_cast<int64_t>(instructions.size()))
+        cause = StallCause::DRAIN;
+    else
+        cause = StallCause::FRONTEND;
+
+    proc_stats.stall_cycles[cause] += 1.0 - used;
+    memo_cycle.cause = cause;
 }
 
 void Pipeline::execute() {
+    /*
+     * Results due this cycle join the ones still waiting for a result bus;
+     * the oldest (by end of execution, then tag) get the free buses.
+     */
     std::vector<PipelineEntry> sorted;
-    sort_stage(sorted, Stage::EXEC);
+    sorted.swap(stages.exec_done);
+    stages.exec.take(clock, sorted);
+
+    std::sort(sorted.begin(), sorted.end(), [](const PipelineEntry& p1, const PipelineEntry& p2) {
+        if (p1.cycle == p2.cycle)
+            return p1.tag < p2.tag;
+        else
+            return p1.cycle < p2.cycle;
+    });
+
+    size_t placed = 0;
 
     for (PipelineEntry& pe: sorted) {
         // Find correct entry in pipeline
         RS& rs = sched_q[pe.rs_idx];
+        bool on_bus = false;
 
         // Find a free RB
         for (ResultBus &rb: result_buses) {
@@ -432,42 +1420,49 @@ void Pipeline::execute() {
             if (!rb.busy) {
                 rb.busy = true;
                 rb.tag = rs.dest_tag;
-                rb.value = -1; // Don't really care about value from FU!
                 rb.reg_no = rs.dest_reg;
                 rb.inst_idx = rs.inst_idx;
 
                 // Free up the FU
-                int fu_idx = find_fu_by_tag(rs.dest_tag);
-                fu_table[fu_idx].busy = false;
-                rb.fu_id = fu_idx;
+                fu_table[pe.fu_idx].in_flight--;
+                rb.fu_id = pe.fu_idx;
 
                 // Update branch predictor (GHR + Smith counter)
                 // Also, allow dispatch to continue
-                Instruction &inst = instructions[pe.inst_idx];
+                const Instruction &inst = instructions[pe.inst_idx];
                 if (inst.branch_addr != -1) {
-                    if (inst.taken != inst.p_taken)
+                    if (pe.inst_idx == mp_idx) {
                         mp = Misprediction::NONE;
+                        mp_idx = -1;
+                    }
 
-                    predictor->update(inst.addr, inst.taken);
+                    predictor->update(static_cast<uint64_t>(inst.addr), inst.taken);
                 }
 
                 // Advance to UPDATE stage
-                InstStatus& is = status[pe.inst_idx];
-                is.state = clock;
-                is.stage = Stage::UPDATE;
+                status.state[pe.inst_idx] = clock;
+                status.stage[pe.inst_idx] = Stage::UPDATE;
+
+                if (pipeview != NULL)
+                    pipeview->record(clock, pe.inst_idx, PV_UPDATE, static_cast<int>(&rb - &result_buses[0]));
 
                 pe.cycle = clock;
                 stages.update.push_back(pe);
 
-                // Remove from EXEC stage
-                stages.exec.remove_if([pe](PipelineEntry p1) {
-                    return pe.inst_idx == p1.inst_idx;
-                });
-
+                on_bus = true;
+                placed++;
                 break;
             }
         }
+
+        if (!on_bus)
+            stages.exec_done.push_back(pe);
     }
+
+    rb_stall = placed < sorted.size();
+
+    if (rb_stall)
+        note_short(RES_RB);
 }
 
 void Pipeline::state_update() {
@@ -487,16 +1482,14 @@ void Pipeline::state_update() {
             if (rb.reg_no != -1) {
                 Register &reg = reg_file[rb.reg_no];
 
-                if (reg.tag == rb.tag) {
+                if (reg.tag == rb.tag)
                     reg.ready = true;
-                    reg.value = rb.value;
-                }
             }
 
             rb.busy = false;
 
             // Instruction completed
-            status[pe.inst_idx].stage = Stage::DONE;
+            status.stage[pe.inst_idx] = Stage::DONE;
             pe.cycle = clock;
 
             // Remove from UPDATE
@@ -518,7 +1511,16 @@ int Pipeline::retire() {
 
     for (PipelineEntry& pe: copy) {
         // Mark as completed
-        status[pe.inst_idx].stage = Stage::DONE;
+        status.stage[pe.inst_idx] = Stage::DONE;
+
+        if (pipeview != NULL)
+            pipeview->record(clock, pe.inst_idx, PV_RETIRE);
+
+        if (profile != NULL) {
+            int64_t i = pe.inst_idx;
+            profile->record(instructions[i].addr, status.sched[i] - status.disp[i],
+                            status.exec[i] - status.sched[i], status.state[i] - status.exec[i]);
+        }
 
         // Remove instruction from schedq
         RS& rs = sched_q[pe.rs_idx];
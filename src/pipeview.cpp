@@ -0,0 +1,129 @@
+#include "pipeview.hpp"
+
+// Kanata stage names, indexed by PipeViewStage
+static const char* STAGE_NAMES[] = {"F", "Ds", "Sc", "Ex", "Su", "Rt"};
+
+// Labels shown next to the resource id in the viewer's hover text
+static const char* RESOURCE_NAMES[] = {"", "", "rs", "fu", "rb", ""};
+
+PipeViewWriter::~PipeViewWriter() {
+    close();
+}
+
+bool PipeViewWriter::open(const std::string& file, TraceView ins, int64_t first_inst, int64_t last_inst, std::string& err) {
+    out.open(file);
+
+    if (!out.is_open()) {
+        err = "Unable to open pipeline view file (" + file + ")";
+        return false;
+    }
+
+    trace = ins;
+    first = first_inst;
+    last = last_inst;
+    done = false;
+    started = false;
+
+    batch.reserve(BATCH_SIZE);
+    out << "Kanata\t0004" << std::endl;
+
+    writer = std::thread(&PipeViewWriter::run, this);
+    return true;
+}
+
+void PipeViewWriter::close() {
+    if (!writer.joinable())
+        return;
+
+    if (!batch.empty())
+        submit();
+
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        done = true;
+    }
+
+    cv.notify_one();
+    writer.join();
+    out.close();
+}
+
+void PipeViewWriter::submit() {
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        full.push_back(std::vector<PipeViewEvent>());
+        full.back().swap(batch);
+    }
+
+    cv.notify_one();
+    batch.reserve(BATCH_SIZE);
+}
+
+void PipeViewWriter::run() {
+    std::vector<std::vector<PipeViewEvent>> work;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard (lock);
+            cv.wait(guard, [this] { return done || !full.empty(); });
+
+            if (full.empty() && done)
+                return;
+
+            work.swap(full);
+        }
+
+        for (std::vector<PipeViewEvent>& events: work) {
+            for (PipeViewEvent& ev: events)
+                write_event(ev);
+        }
+
+        work.clear();
+    }
+}
+
+void PipeViewWriter::write_event(const PipeViewEvent& ev) {
+    // Events arrive in cycle order; Kanata wants the clock advanced in deltas
+    if (!started) {
+        out << "C=\t" << ev.cycle << "\n";
+        last_cycle = ev.cycle;
+        started = true;
+    } else if (ev.cycle > last_cycle) {
+        out << "C\t" << (ev.cycle - last_cycle) << "\n";
+        last_cycle = ev.cycle;
+    }
+
+    int64_t id = ev.inst;
+
+    switch (ev.stage) {
+        case PV_FETCH: {
+            const Instruction& inst = trace[id];
+
+            // Numbered from 1 to match the rows of the .out file
+            out << "I\t" << id << "\t" << id + 1 << "\t0\n";
+            out << "L\t" << id << "\t0\t" << std::hex << static_cast<uint64_t>(inst.addr) << std::dec;
+            out << " k" << static_cast<int>(inst.fu_type) << " r" << static_cast<int>(inst.dest_reg);
+            out << " <- r" << static_cast<int>(inst.src_reg[0]) << ", r" << static_cast<int>(inst.src_reg[1]);
+
+            if (inst.branch_addr != -1)
+                out << (inst.taken ? " (branch, taken)" : " (branch, not taken)");
+
+            out << "\n";
+            out << "S\t" << id << "\t0\t" << STAGE_NAMES[PV_FETCH] << "\n";
+            break;
+        }
+        case PV_MISPREDICT:
+            out << "L\t" << id << "\t1\tmispredicted; dispatch stalled until it executes\n";
+            break;
+        case PV_RETIRE:
+            out << "S\t" << id << "\t0\t" << STAGE_NAMES[PV_RETIRE] << "\n";
+            out << "R\t" << id << "\t" << id << "\t0\n";
+            break;
+        default:
+            out << "S\t" << id << "\t0\t" << STAGE_NAMES[ev.stage] << "\n";
+
+            if (ev.resource != -1)
+                out << "L\t" << id << "\t1\t" << RESOURCE_NAMES[ev.stage] << "=" << ev.resource << "\n";
+            break;
+    }
+}
@@ -17,9 +17,10 @@ BranchPredictor::BranchPredictor(int n, int k) : n(n), k(k) {
     }
 }
 
-bool BranchPredictor::predict(int address) {
-    // Compute hash of address using given formula
-    int hash = (address / 4) % n;
+bool BranchPredictor::predict(uint64_t address) {
+    // Compute hash of address using given formula, in unsigned arithmetic
+    // so 64-bit addresses can't index out of the table
+    int hash = index(address);
 
     // Perform lookup in table to find required Smith counter
     std::vector<int>& counters = prediction_table[hash];
@@ -30,9 +31,9 @@ bool BranchPredictor::predict(int address) {
     return prediction;
 }
 
-void BranchPredictor::update(int address, bool taken) {
+void BranchPredictor::update(uint64_t address, bool taken) {
     // Update Smith counter value based on actual branch result
-    int hash = (address / 4) % n;
+    int hash = index(address);
     std::vector<int>& counters = prediction_table[hash];
 
     if (taken) {
@@ -54,3 +55,10 @@ void BranchPredictor::update(int address, bool taken) {
         ghr = (ghr << 1) & ((1 << ghr_size) - 1);
     }
 }
+
+void BranchPredictor::snapshot(std::vector<int64_t>& out) const {
+    out.push_back(ghr);
+
+    for (const std::vector<int>& counters: prediction_table)
+        out.insert(out.end(), counters.begin(), counters.end());
+}
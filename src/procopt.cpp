@@ -1,130 +1,1117 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <vector>
 #include <cmath>
 #include <fstream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <getopt.h>
+#include <unistd.h>
 
+#include "analyze.hpp"
 #include "pipeline.hpp"
+#include "procsim.hpp"
 #include "util.hpp"
 
 struct PipelineRun {
     int F, J, K, L, R;
     double ipc;
     double prediction_accuracy;
+    double cpi_stack[NUM_STALL_CAUSES];
+    uint64_t simulated; // Instructions actually simulated
+    uint64_t cycles, resumed; // Cycles run, and how many came from the previous run
+    int rounds; // Rounds of a budgeted sweep the run took part in
 };
 
-int main() {
+/*
+ * The sweep: every trace is simulated with every combination of the
+ * F/J/K/L/R values. Points are numbered trace by trace, each trace's
+ * configurations nested F, J, K, L, R (R fastest), which fixes both the
+ * shard assignment and the order results are reported in.
+ */
+struct Sweep {
+    std::vector<std::string> traces;
+    std::vector<int> F, J, K, L, R;
+    double converge_tol;
+    std::string mem_spec; // Cache hierarchy for every run; empty = off
+    MemoryOptions mem;
+    int fetch_q_size, disp_q_size; // Front-end queue capacities, 0 = unbounded
+    bool memo; // Replay repeated loop iterations; doesn't change results
+    std::string latency_spec; // FU latencies for every run; empty = 1 cycle
+    int latency[3];
+    bool pipelined[3];
+    bool resume; // Pick up from the previous config's run; doesn't change results
+    size_t phase_interval, phase_warmup; // --phases, in instructions
+    double phase_threshold; // See split_phases()
+    uint64_t budget_instructions; // --budget, per trace; 0 = none
+    double budget_seconds;
+
+    inline size_t configs() const {
+        return F.size() * J.size() * K.size() * L.size() * R.size();
+    }
+};
+
+static void usage() {
+    std::cout << "Usage: ./procopt [-c TOL] [--config FILE] [--auto] [--phases | --budget N[s]] [--shard I/N] [--out FILE]" << std::endl;
+    std::cout << "       ./procopt --merge PARTIAL..." << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+static void default_sweep(Sweep& sweep) {
+    sweep.traces = {"traces/hmmer_branch.100k.trace",
+                    "traces/gcc_branch.100k.trace",
+                    "traces/gobmk_branch.100k.trace",
+                    "traces/mcf_branch.100k.trace"};
+    sweep.F = {4, 8};
+    sweep.J = {1, 2};
+    sweep.K = {1, 2};
+    sweep.L = {1, 2};
+    sweep.R = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    sweep.converge_tol = 0;
+    sweep.mem_spec.clear();
+    sweep.mem = {};
+    sweep.fetch_q_size = sweep.disp_q_size = 0;
+    sweep.memo = false;
+    sweep.latency_spec.clear();
+    std::fill(sweep.latency, sweep.latency + 3, 0);
+    std::fill(sweep.pipelined, sweep.pipelined + 3, false);
+    sweep.resume = true;
+    sweep.phase_interval = 10000;
+    sweep.phase_warmup = 5000;
+    sweep.phase_threshold = 0.5;
+    sweep.budget_instructions = 0;
+    sweep.budget_seconds = 0;
+}
+
+// Parse "1,2,4" or "1-10" (or a mix, "1-4,8") into values
+static bool parse_values(const std::string& s, std::vector<int>& values) {
+    std::istringstream iss (s);
+    std::string item;
+
+    values.clear();
+
+    while (getline(iss, item, ',')) {
+        char* end = NULL;
+        long lo = strtol(item.c_str(), &end, 10);
+        long hi = lo;
+
+        if (end == item.c_str())
+            return false;
+
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+
+        if (hi < lo)
+            return false;
+
+        for (long v = lo; v <= hi; v++)
+            values.push_back(static_cast<int>(v));
+    }
+
+    return !values.empty();
+}
+
+// Parse a --budget: "N" simulated instructions or "Ns" seconds, per trace
+static bool parse_budget(const std::string& s, Sweep& sweep) {
+    char* end = NULL;
+    double v = strtod(s.c_str(), &end);
+
+    if (end == s.c_str() || v <= 0)
+        return false;
+
+    sweep.budget_instructions = 0;
+    sweep.budget_seconds = 0;
+
+    if (std::string(end) == "s")
+        sweep.budget_seconds = v;
+    else if (*end == '\0')
+        sweep.budget_instructions = static_cast<uint64_t>(v);
+    else
+        return false;
+
+    return true;
+}
+
+// Options for configuration number idx of a trace
+static PipelineOptions config_at(const Sweep& sweep, size_t idx) {
     PipelineOptions options = {};
+    options.converge_tol = sweep.converge_tol;
+    options.mem = sweep.mem;
+    options.fetch_q_size = sweep.fetch_q_size;
+    options.disp_q_size = sweep.disp_q_size;
+    options.memo = sweep.memo;
+    std::copy(sweep.latency, sweep.latency + 3, options.latency);
+    std::copy(sweep.pipelined, sweep.pipelined + 3, options.pipelined);
+
+    options.R = sweep.R[idx % sweep.R.size()];
+    idx /= sweep.R.size();
+    options.L = sweep.L[idx % sweep.L.size()];
+    idx /= sweep.L.size();
+    options.K = sweep.K[idx % sweep.K.size()];
+    idx /= sweep.K.size();
+    options.J = sweep.J[idx % sweep.J.size()];
+    idx /= sweep.J.size();
+    options.F = sweep.F[idx];
+
+    return options;
+}
+
+// Every option is bounded below, so a sweep is valid if its smallest config is
+static bool check_sweep(const Sweep& sweep, std::string& err) {
+    PipelineOptions options = config_at(sweep, 0);
+    options.F = *std::min_element(sweep.F.begin(), sweep.F.end());
+    options.J = *std::min_element(sweep.J.begin(), sweep.J.end());
+    options.K = *std::min_element(sweep.K.begin(), sweep.K.end());
+    options.L = *std::min_element(sweep.L.begin(), sweep.L.end());
+    options.R = *std::min_element(sweep.R.begin(), sweep.R.end());
+
+    return validate_options(options, err);
+}
+
+/*
+ * Sweep config file: one "key = value" per line, '#' starts a comment.
+ *   trace = traces/gcc_branch.100k.trace   (repeat for each trace)
+ *   F = 4,8
+ *   R = 1-10
+ *   converge_tol = 0.01
+ *   mem = default                          (see procsim -m)
+ *   queues = 16:32                         (see procsim -q)
+ *   memo = 1                               (see procsim -z)
+ *   latency = 1,3p,12                      (see procsim -x)
+ *   resume = 0                             (simulate every config from scratch)
+ *   phase_interval = 10000                 (--phases: phase granularity)
+ *   phase_warmup = 5000                    (--phases: instructions run first)
+ *   phase_threshold = 0.5                  (--phases: see split_phases())
+ *   budget = 30s                           (see --budget)
+ * Keys left out keep the default sweep's values.
+ */
+static bool load_sweep(const std::string& file, Sweep& sweep, std::string& err) {
+    std::ifstream in (file);
+
+    if (!in.is_open()) {
+        err = "Unable to open sweep config (" + file + ")";
+        return false;
+    }
+
+    std::vector<std::string> traces;
+    std::string line;
+    int line_no = 0;
+
+    while (getline(in, line)) {
+        line_no++;
+        line = line.substr(0, line.find('#'));
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+
+            err = file + ":" + std::to_string(line_no) + ": expected key = value";
+            return false;
+        }
+
+        std::string key = line.substr(0, eq);
+        std::string value = line.substr(eq + 1);
+        key.erase(0, key.find_first_not_of(" \t"));
+        key.erase(key.find_last_not_of(" \t\r") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+
+        bool ok = true;
+
+        if (key == "trace")
+            traces.push_back(value);
+        else if (key == "F")
+            ok = parse_values(value, sweep.F);
+        else if (key == "J")
+            ok = parse_values(value, sweep.J);
+        else if (key == "K")
+            ok = parse_values(value, sweep.K);
+        else if (key == "L")
+            ok = parse_values(value, sweep.L);
+        else if (key == "R")
+            ok = parse_values(value, sweep.R);
+        else if (key == "converge_tol")
+            ok = parse_tolerance(value, sweep.converge_tol);
+        else if (key == "mem")
+            ok = parse_memory_spec(value, sweep.mem, err);
+        else if (key == "queues")
+            ok = parse_queue_sizes(value, sweep.fetch_q_size, sweep.disp_q_size);
+        else if (key == "memo")
+            sweep.memo = strtol(value.c_str(), NULL, 10) != 0;
+        else if (key == "latency")
+            ok = parse_fu_latencies(value, sweep.latency, sweep.pipelined);
+        else if (key == "resume")
+            sweep.resume = strtol(value.c_str(), NULL, 10) != 0;
+        else if (key == "phase_interval")
+            ok = (sweep.phase_interval = strtoul(value.c_str(), NULL, 10)) > 0;
+        else if (key == "phase_warmup")
+            sweep.phase_warmup = strtoul(value.c_str(), NULL, 10);
+        else if (key == "phase_threshold")
+            sweep.phase_threshold = strtod(value.c_str(), NULL);
+        else if (key == "budget")
+            ok = parse_budget(value, sweep);
+        else
+            ok = false;
+
+        if (key == "mem" && ok)
+            sweep.mem_spec = value;
+
+        if (key == "latency" && ok)
+            sweep.latency_spec = value;
+
+        if (ok)
+            ok = check_sweep(sweep, err);
+
+        if (!ok) {
+            err = file + ":" + std::to_string(line_no) + ": bad entry '" + key + "'" + (err.empty() ? "" : " (" + err + ")");
+            return false;
+        }
+    }
+
+    if (!traces.empty())
+        sweep.traces = traces;
+
+    return true;
+}
+
+// Drop axis values above cap, keeping at least the smallest one
+static void cap_axis(std::vector<int>& axis, int cap) {
+    int smallest = *std::min_element(axis.begin(), axis.end());
+
+    axis.erase(std::remove_if(axis.begin(), axis.end(), [cap](int v) { return v > cap; }), axis.end());
+
+    if (axis.empty())
+        axis.push_back(smallest);
+}
+
+/*
+ * --auto: narrow the sweep using each trace's analysis (procsim --analyze).
+ * A FU type is capped at twice its average demand per cycle at the widest F,
+ * which leaves room for bursts; k1 units also take FU type -1, and units
+ * that aren't pipelined are busy for their whole latency. R is capped at
+ * the most results a configuration's FUs can hold at once, as each holds
+ * its results until they're on a bus. Caps are the largest any trace needs.
+ */
+static void narrow_sweep(Sweep& sweep) {
+    int f_max = *std::max_element(sweep.F.begin(), sweep.F.end());
+    int caps[3] = {1, 1, 1};
+
+    for (const std::string& trace: sweep.traces) {
+        std::vector<Instruction> instructions;
+        parse_trace(trace, instructions);
+
+        TraceAnalysis a;
+        analyze_trace(instructions, a);
+
+        double demand[3] = {a.fu_share(0), a.fu_share(1) + a.fu_share(-1), a.fu_share(2)};
+
+        for (int t = 0; t < 3; t++) {
+            int busy = sweep.pipelined[t] ? 1 : std::max(1, sweep.latency[t]);
+            caps[t] = std::max(caps[t], static_cast<int>(std::ceil(2 * f_max * demand[t] * busy)));
+        }
+    }
+
+    std::vector<int>* fus[] = {&sweep.J, &sweep.K, &sweep.L};
+    int held_max = 0;
+
+    for (int t = 0; t < 3; t++) {
+        cap_axis(*fus[t], caps[t]);
+
+        int depth = sweep.pipelined[t] ? std::max(1, sweep.latency[t]) : 1;
+        held_max += *std::max_element(fus[t]->begin(), fus[t]->end()) * depth;
+    }
+
+    cap_axis(sweep.R, held_max);
+
+    const char* names[] = {"F", "J", "K", "L", "R"};
+    const std::vector<int>* axes[] = {&sweep.F, &sweep.J, &sweep.K, &sweep.L, &sweep.R};
+
+    std::cout << "Auto sweep:";
+    for (int i = 0; i < 5; i++) {
+        std::cout << " " << names[i] << "=";
+        for (size_t v = 0; v < axes[i]->size(); v++)
+            std::cout << (v ? "," : "") << (*axes[i])[v];
+    }
+    std::cout << " (" << sweep.configs() << " configurations per trace)" << std::endl;
+}
+
+// Identifies a sweep, so partial results of different sweeps aren't merged
+static std::string sweep_id(const Sweep& sweep) {
+    std::ostringstream desc;
+    desc.precision(17);
+
+    for (const std::string& t: sweep.traces)
+        desc << t << ";";
+
+    const std::vector<int>* axes[] = {&sweep.F, &sweep.J, &sweep.K, &sweep.L, &sweep.R};
+    for (const std::vector<int>* axis: axes) {
+        for (int v: *axis)
+            desc << v << ",";
+        desc << ";";
+    }
+
+    desc << sweep.converge_tol << ";" << sweep.mem_spec;
+
+    // Left out when unbounded so ids of existing sweeps don't change
+    if (sweep.fetch_q_size != 0 || sweep.disp_q_size != 0)
+        desc << ";" << sweep.fetch_q_size << ":" << sweep.disp_q_size;
+
+    if (!sweep.latency_spec.empty())
+        desc << ";x" << sweep.latency_spec;
+
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (char c: desc.str()) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ULL;
+    }
+
+    std::ostringstream id;
+    id << std::hex << h;
+    return id.str();
+}
+
+// Results of a finished run
+static PipelineRun record(const Pipeline& p, const PipelineOptions& options) {
+    PipelineRun pr = {};
+    pr.F = options.F;
+    pr.J = options.J;
+    pr.K = options.K;
+    pr.L = options.L;
+    pr.R = options.R;
+    pr.ipc = p.proc_stats.avg_inst_retired;
+    pr.prediction_accuracy = p.proc_stats.prediction_accuracy;
+    std::copy(p.proc_stats.cpi_stack, p.proc_stats.cpi_stack + NUM_STALL_CAUSES, pr.cpi_stack);
+    pr.simulated = p.proc_stats.simulated_instructions;
+    pr.cycles = p.proc_stats.cycle_count;
+    pr.resumed = std::min(p.proc_stats.resumed_cycles, pr.cycles);
+
+    return pr;
+}
+
+// Configs along the R axis (and J/K/L within a row) mostly add resources
+// the previous one rarely ran short of, so with resume each run picks up
+// from the one before it where it can (Pipeline::start_from). The finished
+// run is left in last.
+static PipelineRun simulate(TraceView trace, const PipelineOptions& options, bool resume,
+                            std::unique_ptr<Pipeline>& last) {
+    // Setup a Pipeline simulator
+    std::unique_ptr<Pipeline> run (new Pipeline(trace, options));
+    Pipeline& p = *run;
+    p.resumable = resume;
+
+    if (resume && last)
+        p.start_from(*last);
+    else
+        p.start();
+
+    PipelineRun pr = record(p, options);
+    last = std::move(run);
+
+    return pr;
+}
+
+// Append one trace's section to procopt.out and procopt.full.out.
+// results must be in sweep order so ties rank the same way every time.
+// Runs of a budgeted sweep rank by the rounds they lasted first, as IPCs
+// over different prefixes don't compare.
+static void write_report(const std::string& trace, std::vector<PipelineRun>& results,
+                         std::ofstream& outfile, std::ofstream& full_data, bool by_prefix = false) {
+    outfile << "# Results for " << trace << std::endl;
+    outfile << "====================================================" << std::endl;
+
+    full_data << "# Results for " << trace << std::endl;
+
+    // Sort pipeline runs by IPC
+    std::sort(results.begin(), results.end(), [by_prefix](const PipelineRun& pr1, const PipelineRun& pr2) {
+        if (by_prefix && pr1.rounds != pr2.rounds)
+            return pr1.rounds > pr2.rounds;
+        return pr1.ipc > pr2.ipc;
+    });
+
+    const double best_ipc = results[0].ipc;
+
+    std::vector<PipelineRun> candidates;
+
+    full_data << "F,J,K,L,R,IPC,Accuracy,Ratio,Simulated";
+    for (int c = 0; c < NUM_STALL_CAUSES; c++)
+        full_data << ",CPI_" << stall_cause_name(c);
+    full_data << std::endl;
+
+    for (PipelineRun& pr: results) {
+        double ratio = pr.ipc / best_ipc;
+
+        // Consider runs with >95% of best IPC
+        if (pr.ipc > 0.95*best_ipc && (!by_prefix || pr.rounds == results[0].rounds))
+            candidates.push_back(pr);
+
+        full_data << pr.F << "," << pr.J << "," << pr.K << ",";
+        full_data << pr.L << "," << pr.R << "," << pr.ipc << ",";
+        full_data << pr.prediction_accuracy*100 << "," << (ratio*100) << "," << pr.simulated;
+        for (int c = 0; c < NUM_STALL_CAUSES; c++)
+            full_data << "," << pr.cpi_stack[c];
+        full_data << std::endl;
+    }
+
+    outfile << std::endl << "* >95% of Best IPC (" << best_ipc << ")" << std::endl;
+
+    // Output all candidates
+    for (PipelineRun& pr: candidates) {
+        outfile << "- F: " << pr.F << " J: " << pr.J << " K: " << pr.K;
+        outfile << " L: " << pr.L << " R: " << pr.R << std::endl;
+        outfile << "--- Prediction accuracy: " << pr.prediction_accuracy*100 << "%" << std::endl;
+        outfile << "--- Best IPC: " << best_ipc << ", Found IPC: " << pr.ipc << " (" << (pr.ipc / best_ipc)*100 << "%)" << std::endl;
+    }
+
+    // Find the best pipeline configuration
+    std::sort(candidates.begin(), candidates.end(), [](const PipelineRun& pr1, const PipelineRun& pr2) {
+        return (pr1.J + pr1.K + pr1.L + pr1.R) < (pr2.J + pr2.K + pr2.L + pr2.R);
+    });
+
+    // Best configuration
+    PipelineRun& pr = candidates[0];
+
+    outfile << std::endl << "* Cheapest Configuration" << std::endl;
+    outfile << "- F: " << pr.F << " J: " << pr.J << " K: " << pr.K;
+    outfile << " L: " << pr.L << " R: " << pr.R << std::endl;
+    outfile << "--- Prediction accuracy: " << pr.prediction_accuracy*100 << "%" << std::endl;
+    outfile << "--- Best IPC: " << best_ipc << ", Found IPC: " << pr.ipc << " (" << (pr.ipc / best_ipc)*100 << "%)" << std::endl;
+
+    outfile << "====================================================" << std::endl << std::endl;
+
+    full_data << "====================================================" << std::endl;
+}
+
+/*
+ * Partial result files, one per shard:
+ *   # procopt-partial sweep=<id> shard=<i>/<n> traces=<t> configs=<c>
+ *   # trace <trace_idx> <path>
+ *   <trace_idx>,<config_idx>,F,J,K,L,R,ipc,accuracy,simulated,cpi...
+ * Doubles are written with full precision so a merge reproduces the
+ * reports of an unsharded run exactly.
+ */
+static void run_shard(const Sweep& sweep, int shard, int num_shards, const std::string& out_file) {
+    std::ofstream out (out_file);
+
+    if (!out.is_open())
+        exit_on_error("Unable to open partial result file (" + out_file + ")");
+
+    size_t configs = sweep.configs();
+
+    out << "# procopt-partial sweep=" << sweep_id(sweep) << " shard=" << shard << "/" << num_shards;
+    out << " traces=" << sweep.traces.size() << " configs=" << configs << std::endl;
+
+    for (size_t t = 0; t < sweep.traces.size(); t++)
+        out << "# trace " << t << " " << sweep.traces[t] << std::endl;
+
+    out.precision(17);
+
+    for (size_t t = 0; t < sweep.traces.size(); t++) {
+        // Points are dealt round-robin, so every shard gets a slice of every trace
+        size_t first = (num_shards - (t * configs) % num_shards + shard) % num_shards;
+
+        if (first >= configs)
+            continue;
+
+        std::vector<Instruction> instructions;
+        parse_trace(sweep.traces[t], instructions);
+
+        std::cout << "Optimizing " << sweep.traces[t] << " (shard " << shard << "/" << num_shards << ")" << std::endl;
+
+        std::unique_ptr<Pipeline> last;
+
+        for (size_t c = first; c < configs; c += num_shards) {
+            PipelineRun pr = simulate(instructions, config_at(sweep, c), sweep.resume, last);
+
+            out << t << "," << c << "," << pr.F << "," << pr.J << "," << pr.K << ",";
+            out << pr.L << "," << pr.R << "," << pr.ipc << "," << pr.prediction_accuracy << ",";
+            out << pr.simulated;
+            for (int i = 0; i < NUM_STALL_CAUSES; i++)
+                out << "," << pr.cpi_stack[i];
+            out << std::endl;
+        }
+
+        std::cout << "Trace " << sweep.traces[t] << " completed." << std::endl;
+    }
+
+    out.close();
+}
+
+static void merge(const std::vector<std::string>& files) {
+    std::string sweep;
+    size_t configs = 0;
+    std::vector<std::string> traces;
+
+    // results[trace][config], found[trace][config]
+    std::vector<std::vector<PipelineRun>> results;
+    std::vector<std::vector<bool>> found;
+
+    for (const std::string& file: files) {
+        std::ifstream in (file);
+
+        if (!in.is_open())
+            exit_on_error("Unable to open partial result file (" + file + ")");
+
+        std::string line;
+        getline(in, line);
+
+        std::istringstream header (line);
+        std::string tag, id, shard, num_traces, num_configs;
+        header >> tag >> tag >> id >> shard >> num_traces >> num_configs;
+
+        if (tag != "procopt-partial" || id.compare(0, 6, "sweep=") != 0)
+            exit_on_error(file + " is not a procopt partial result file");
+
+        size_t t_count = strtoul(num_traces.c_str() + 7, NULL, 10);
+        size_t c_count = strtoul(num_configs.c_str() + 8, NULL, 10);
+
+        if (sweep.empty()) {
+            sweep = id;
+            configs = c_count;
+            traces.resize(t_count);
+            results.assign(t_count, std::vector<PipelineRun>(c_count));
+            found.assign(t_count, std::vector<bool>(c_count, false));
+        } else if (id != sweep) {
+            exit_on_error(file + " belongs to a different sweep");
+        }
+
+        while (getline(in, line)) {
+            if (line.compare(0, 8, "# trace ") == 0) {
+                std::istringstream iss (line.substr(8));
+                size_t t;
+                std::string path;
+                iss >> t;
+                getline(iss >> std::ws, path);
 
-    int f, j, k, l, r;
+                if (t < traces.size())
+                    traces[t] = path;
+                continue;
+            }
+
+            std::istringstream iss (line);
+            std::string field;
+            std::vector<std::string> fields;
+
+            while (getline(iss, field, ','))
+                fields.push_back(field);
+
+            if (fields.size() != 10 + NUM_STALL_CAUSES)
+                exit_on_error(file + ": malformed result line");
+
+            size_t t = strtoul(fields[0].c_str(), NULL, 10);
+            size_t c = strtoul(fields[1].c_str(), NULL, 10);
+
+            if (t >= traces.size() || c >= configs)
+                exit_on_error(file + ": result outside of the sweep");
+
+            PipelineRun& pr = results[t][c];
+            pr.F = atoi(fields[2].c_str());
+            pr.J = atoi(fields[3].c_str());
+            pr.K = atoi(fields[4].c_str());
+            pr.L = atoi(fields[5].c_str());
+            pr.R = atoi(fields[6].c_str());
+            pr.ipc = strtod(fields[7].c_str(), NULL);
+            pr.prediction_accuracy = strtod(fields[8].c_str(), NULL);
+            pr.simulated = strtoull(fields[9].c_str(), NULL, 10);
+            for (int i = 0; i < NUM_STALL_CAUSES; i++)
+                pr.cpi_stack[i] = strtod(fields[10 + i].c_str(), NULL);
+
+            found[t][c] = true;
+        }
+    }
+
+    // Every point must be present before the reports are written
+    size_t missing = 0;
+    for (std::vector<bool>& f: found)
+        missing += std::count(f.begin(), f.end(), false);
+
+    if (missing > 0)
+        exit_on_error(std::to_string(missing) + " results missing; re-run the failed shards");
 
     std::ofstream outfile ("procopt.out");
     std::ofstream full_data ("procopt.full.out");
 
-    std::vector<std::string> traces = {"traces/hmmer_branch.100k.trace",
-                                       "traces/gcc_branch.100k.trace",
-                                       "traces/gobmk_branch.100k.trace",
-                                       "traces/mcf_branch.100k.trace"};
+    for (size_t t = 0; t < traces.size(); t++)
+        write_report(traces[t], results[t], outfile, full_data);
+
+    outfile.close();
+    full_data.close();
+
+    std::cout << "Merged " << files.size() << " partial result files" << std::endl;
+}
+
+// One phase of a trace and its sweep
+struct Phase {
+    size_t begin, end; // Trace positions, end exclusive
+    size_t warmup; // Instructions before begin simulated but not measured
+    std::vector<PipelineRun> runs; // In sweep order
+    std::vector<uint64_t> cycles; // Measured cycles of each run
+};
+
+// Cycles from the state update of the last warmup instruction to that of
+// the last instruction in the phase
+static uint64_t phase_cycles(const InstStatus& is, size_t warmup) {
+    uint64_t warm = 0, done = 0;
+
+    for (size_t i = 0; i < is.size(); i++) {
+        uint64_t c = is.cycle(is.state, i);
+
+        if (i < warmup)
+            warm = std::max(warm, c);
+        else
+            done = std::max(done, c);
+    }
+
+    return std::max<uint64_t>(done - warm, 1);
+}
+
+// Sweep one phase, warming the predictor, queues and caches on the
+// instructions just before it
+static void simulate_phase(const Sweep& sweep, TraceView trace, Phase& ph) {
+    TraceView view (trace.data + ph.begin - ph.warmup, ph.end - ph.begin + ph.warmup);
+    std::unique_ptr<Pipeline> last;
+
+    for (size_t c = 0; c < sweep.configs(); c++) {
+        PipelineOptions options = config_at(sweep, c);
+        options.converge_tol = 0; // Every instruction's timing is needed
 
-    for (std::string& trace: traces) {
+        ph.runs.push_back(simulate(view, options, sweep.resume, last));
+        ph.cycles.push_back(phase_cycles(last->status, ph.warmup));
+        ph.runs.back().ipc = static_cast<double>(ph.end - ph.begin) / ph.cycles.back();
+    }
+}
+
+// FUs and result buses, the resources a cheaper configuration saves
+static inline int resources(const PipelineRun& pr) {
+    return pr.J + pr.K + pr.L + pr.R;
+}
+
+static void write_config(std::ofstream& out, const PipelineRun& pr) {
+    out << "F: " << pr.F << " J: " << pr.J << " K: " << pr.K;
+    out << " L: " << pr.L << " R: " << pr.R;
+}
+
+/*
+ * --phases: split each trace into phases (split_phases()) and sweep every
+ * phase on its own, in parallel, into procopt.phases.out. The best static
+ * configuration is the one with the fewest cycles over all phases; a
+ * reconfigurable machine runs each phase on that phase's best. As more
+ * resources rarely hurt, both are also compared within each budget of FUs
+ * plus result buses, where a reconfigurable machine moves a fixed set of
+ * resources between phases. Gains leave out the cost of reconfiguring.
+ */
+static void run_phases(const Sweep& sweep) {
+    std::ofstream out ("procopt.phases.out");
+
+    for (const std::string& trace: sweep.traces) {
         std::vector<Instruction> instructions;
         parse_trace(trace, instructions);
 
-        std::cout << "Optimizing " << trace << std::endl;
+        std::vector<size_t> starts = split_phases(instructions, sweep.phase_interval, sweep.phase_threshold);
+        std::vector<Phase> phases (starts.size());
 
-        outfile << "# Results for " << trace << std::endl;
-        outfile << "====================================================" << std::endl;
+        for (size_t p = 0; p < phases.size(); p++) {
+            phases[p].begin = starts[p];
+            phases[p].end = p + 1 < starts.size() ? starts[p + 1] : instructions.size();
+            phases[p].warmup = std::min(sweep.phase_warmup, starts[p]);
+        }
 
-        full_data << "# Results for " << trace << std::endl;
+        std::cout << "Optimizing " << trace << " (" << phases.size() << " phases)" << std::endl;
 
-        std::vector<PipelineRun> results;
-        results.reserve(160);
-
-        for (f = 4; f <= 8; f += 4) {
-            for (j = 1; j <= 2; j++) {
-                for (k = 1; k <= 2; k++) {
-                    for (l = 1; l <= 2; l++) {
-                        for (r = 1; r <= 10; r++) {
-                            // Setup options
-                            options.F = f;
-                            options.J = j;
-                            options.K = k;
-                            options.L = l;
-                            options.R = r;
-
-                            // Setup a Pipeline simulator
-                            Pipeline p (instructions, options);
-                            p.start();
-
-                            // Save results of run
-                            PipelineRun pr = {};
-                            pr.F = f;
-                            pr.J = j;
-                            pr.K = k;
-                            pr.L = l;
-                            pr.R = r;
-                            pr.ipc = p.proc_stats.avg_inst_retired;
-                            pr.prediction_accuracy = p.proc_stats.prediction_accuracy;
-
-                            results.push_back(pr);
-                        }
-                    }
+        // Workers take phases in turn
+        std::atomic<size_t> next (0);
+        auto worker = [&]() {
+            for (size_t p = next++; p < phases.size(); p = next++)
+                simulate_phase(sweep, instructions, phases[p]);
+        };
+
+        size_t num_workers = std::min<size_t>(phases.size(), std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+
+        for (size_t w = 1; w < num_workers; w++)
+            workers.push_back(std::thread(worker));
+
+        worker();
+
+        for (std::thread& t: workers)
+            t.join();
+
+        out << "# Phases of " << trace << std::endl;
+        out << "====================================================" << std::endl;
+
+        size_t measured = 0;
+        uint64_t reconf_cycles = 0;
+        std::vector<uint64_t> static_cycles (sweep.configs(), 0);
+
+        for (size_t p = 0; p < phases.size(); p++) {
+            Phase& ph = phases[p];
+            size_t best = std::min_element(ph.cycles.begin(), ph.cycles.end()) - ph.cycles.begin();
+
+            measured += ph.end - ph.begin;
+            reconf_cycles += ph.cycles[best];
+            for (size_t c = 0; c < sweep.configs(); c++)
+                static_cycles[c] += ph.cycles[c];
+
+            // Cheapest run with >95% of the best IPC, first in sweep order on ties
+            const PipelineRun* cheapest = NULL;
+            for (const PipelineRun& pr: ph.runs) {
+                if (pr.ipc > 0.95*ph.runs[best].ipc && (!cheapest || resources(pr) < resources(*cheapest)))
+                    cheapest = &pr;
+            }
+
+            out << std::endl << "* Phase " << p + 1 << ": instructions " << ph.begin + 1 << "-" << ph.end;
+            out << " (warmup " << ph.warmup << ")" << std::endl;
+            out << "- Best: ";
+            write_config(out, ph.runs[best]);
+            out << std::endl << "--- IPC: " << ph.runs[best].ipc << std::endl;
+            out << "- Cheapest >95%: ";
+            write_config(out, *cheapest);
+            out << std::endl << "--- IPC: " << cheapest->ipc << std::endl;
+        }
+
+        size_t best_static = std::min_element(static_cycles.begin(), static_cycles.end()) - static_cycles.begin();
+        double static_ipc = static_cast<double>(measured) / static_cycles[best_static];
+        double reconf_ipc = static_cast<double>(measured) / reconf_cycles;
+        double gain = (reconf_ipc / static_ipc - 1) * 100;
+
+        out << std::endl << "* Best static configuration" << std::endl << "- ";
+        write_config(out, phases[0].runs[best_static]);
+        out << std::endl << "--- IPC: " << static_ipc << std::endl;
+        out << std::endl << "* Best configuration per phase" << std::endl;
+        out << "--- IPC: " << reconf_ipc << " (" << (gain >= 0 ? "+" : "") << gain << "% over static)" << std::endl;
+
+        std::vector<int> budgets;
+        for (const PipelineRun& pr: phases[0].runs)
+            budgets.push_back(resources(pr));
+
+        std::sort(budgets.begin(), budgets.end());
+        budgets.erase(std::unique(budgets.begin(), budgets.end()), budgets.end());
+
+        double best_gain = 0;
+        int best_budget = 0;
+
+        out << std::endl << "* Within a budget of J+K+L+R" << std::endl;
+
+        for (int b: budgets) {
+            uint64_t s_cycles = UINT64_MAX, r_cycles = 0;
+
+            for (size_t c = 0; c < sweep.configs(); c++) {
+                if (resources(phases[0].runs[c]) <= b)
+                    s_cycles = std::min(s_cycles, static_cycles[c]);
+            }
+
+            for (Phase& ph: phases) {
+                uint64_t fewest = UINT64_MAX;
+                for (size_t c = 0; c < sweep.configs(); c++) {
+                    if (resources(ph.runs[c]) <= b)
+                        fewest = std::min(fewest, ph.cycles[c]);
                 }
+                r_cycles += fewest;
+            }
+
+            double g = (static_cast<double>(s_cycles) / r_cycles - 1) * 100;
+            out << "- " << b << ": static IPC " << static_cast<double>(measured) / s_cycles;
+            out << ", per phase IPC " << static_cast<double>(measured) / r_cycles << " (+" << g << "%)" << std::endl;
+
+            if (g > best_gain) {
+                best_gain = g;
+                best_budget = b;
             }
         }
 
-        // Sort pipeline runs by IPC
-        std::sort(results.begin(), results.end(), [](const PipelineRun& pr1, const PipelineRun& pr2) {
-            return pr1.ipc > pr2.ipc;
-        });
+        out << "====================================================" << std::endl << std::endl;
+
+        std::cout << "Reconfiguring per phase gains " << gain << "% IPC over the best static config";
+        if (best_gain > 0)
+            std::cout << ", and up to " << best_gain << "% within a budget of " << best_budget << " FUs and result buses";
+        std::cout << std::endl;
+        std::cout << "Trace " << trace << " completed." << std::endl;
+    }
+
+    out.close();
+}
+
+// First prefix of a time-budgeted sweep, in retired instructions
+static const uint64_t HALVING_FIRST_PREFIX = 1000;
+
+// Instructions the rounds of a budgeted sweep take until one configuration
+// is left or the trace of n instructions is done, ignoring overshoot
+static uint64_t halving_cost(uint64_t prefix, size_t configs, uint64_t n) {
+    uint64_t cost = 0, done = 0;
+
+    for (prefix = std::min(prefix, n); ; prefix = std::min(2 * prefix, n)) {
+        cost += configs * (prefix - done);
+
+        if (configs == 1 || prefix == n)
+            return cost;
+
+        done = prefix;
+        configs = (configs + 1) / 2;
+    }
+}
+
+/*
+ * --budget: successive halving. Every configuration runs to a short
+ * prefix of the trace; the better half by IPC so far (ties to sweep
+ * order) then carries on from where it paused to twice the prefix, and so
+ * on, a single survivor included, until the next round wouldn't fit the
+ * budget or the trace is done. An instruction budget sets the first prefix
+ * so the rounds down to one survivor fit in it; a budget that covers the
+ * full sweep runs it. A time budget starts at HALVING_FIRST_PREFIX and is
+ * projected from the simulation rate so far. The reports rank configurations by the rounds
+ * they lasted, then IPC, and the Simulated column shows what each one
+ * received.
+ */
+static void run_budgeted(const Sweep& sweep) {
+    std::ofstream outfile ("procopt.out");
+    std::ofstream full_data ("procopt.full.out");
+
+    size_t configs = sweep.configs();
+
+    for (const std::string& trace: sweep.traces) {
+        std::vector<Instruction> instructions;
+        parse_trace(trace, instructions);
+
+        std::cout << "Optimizing " << trace << std::endl;
+
+        std::vector<PipelineOptions> options (configs);
+        std::vector<std::unique_ptr<Pipeline>> runs (configs);
+        std::vector<size_t> alive (configs);
+        std::vector<int> rounds (configs, 0);
+        std::vector<PipelineRun> results (configs);
+
+        // Record a run that is out of the halving and free it
+        auto retire = [&](size_t c) {
+            runs[c]->finish();
+            results[c] = record(*runs[c], options[c]);
+            results[c].rounds = rounds[c];
+            runs[c].reset();
+        };
+
+        for (size_t c = 0; c < configs; c++) {
+            options[c] = config_at(sweep, c);
+            options[c].converge_tol = 0; // Runs pause and carry on instead
+            runs[c].reset(new Pipeline(instructions, options[c]));
+            alive[c] = c;
+        }
+
+        auto began = std::chrono::steady_clock::now();
+        uint64_t spent = 0, prefix = HALVING_FIRST_PREFIX;
+
+        if (sweep.budget_instructions > 0) {
+            while (prefix > 1 && halving_cost(prefix, configs, instructions.size()) > sweep.budget_instructions)
+                prefix /= 2;
+
+            while (prefix < instructions.size() &&
+                   halving_cost(2 * prefix, configs, instructions.size()) <= sweep.budget_instructions)
+                prefix *= 2;
+
+            prefix = std::min<uint64_t>(prefix, instructions.size());
+        }
+
+        while (true) {
+            bool ended = true;
+
+            // Runs advanced this round, best IPC first (ties keep the order
+            // they ran in). Only the better half can carry on, so a run that
+            // falls out of it is recorded and freed right away.
+            size_t keep = (alive.size() + 1) / 2;
+            std::vector<size_t> ranked;
+            std::vector<double> ipc (configs);
 
-        const double best_ipc = results[0].ipc;
-        const float target_ratio = 0.95;
-        double ratio;
+            for (size_t c: alive) {
+                uint64_t before = runs[c]->num_completed;
+                runs[c]->advance(prefix);
+                spent += runs[c]->num_completed - before;
+                ended = ended && runs[c]->ended();
+                rounds[c]++;
+
+                ipc[c] = static_cast<double>(runs[c]->num_completed) / runs[c]->cycles();
+                ranked.insert(std::upper_bound(ranked.begin(), ranked.end(), c, [&ipc](size_t a, size_t b) {
+                    return ipc[a] > ipc[b];
+                }), c);
+
+                if (ranked.size() > keep) {
+                    retire(ranked.back());
+                    ranked.pop_back();
+                }
+            }
 
-        std::vector<PipelineRun> candidates;
+            alive.swap(ranked);
 
-        full_data << "F,J,K,L,R,IPC,Accuracy,Ratio" << std::endl;
+            if (ended)
+                break;
 
-        for (PipelineRun& pr: results) {
-            double ratio = pr.ipc / best_ipc;
+            // Would the next round fit?
+            uint64_t next = std::min<uint64_t>(2 * prefix, instructions.size());
+            uint64_t cost = keep * (next - std::min(prefix, next));
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - began).count();
 
-            // Consider runs with >95% of best IPC
-            if (pr.ipc > 0.95*best_ipc)
-                candidates.push_back(pr);
+            if (sweep.budget_instructions > 0 ? spent + cost > sweep.budget_instructions
+                                              : elapsed + cost * elapsed / std::max<uint64_t>(spent, 1) > sweep.budget_seconds)
+                break;
 
-            full_data << pr.F << "," << pr.J << "," << pr.K << ",";
-            full_data << pr.L << "," << pr.R << "," << pr.ipc << ",";
-            full_data << pr.prediction_accuracy*100 << "," << (ratio*100) << std::endl;
+            prefix = next;
         }
 
-        outfile << std::endl << "* >95% of Best IPC (" << best_ipc << ")" << std::endl;
+        for (size_t c: alive)
+            retire(c);
+
+        write_report(trace, results, outfile, full_data, true);
+
+        std::cout << "Simulated " << spent << " instructions in " << rounds[alive[0]] << " rounds, ";
+        std::cout << spent * 100 / (static_cast<uint64_t>(instructions.size()) * configs) << "% of a full sweep" << std::endl;
+        std::cout << "Trace " << trace << " completed." << std::endl;
+    }
+
+    outfile.close();
+    full_data.close();
+}
+
+int main(int argc, char** argv) {
+    Sweep sweep;
+    default_sweep(sweep);
 
-        // Output all candidates
-        for (PipelineRun& pr: candidates) {
-            outfile << "- F: " << pr.F << " J: " << pr.J << " K: " << pr.K;
-            outfile << " L: " << pr.L << " R: " << pr.R << std::endl;
-            outfile << "--- Prediction accuracy: " << pr.prediction_accuracy*100 << "%" << std::endl;
-            outfile << "--- Best IPC: " << best_ipc << ", Found IPC: " << pr.ipc << " (" << (pr.ipc / best_ipc)*100 << "%)" << std::endl;
+    std::string config_file, out_file;
+    int shard = -1, num_shards = 0;
+    bool merging = false;
+    bool narrow = false;
+    bool phases = false;
+    std::string budget;
+    bool have_tol = false;
+    double tol = 0;
+
+    static const struct option long_opts[] = {
+        {"config", required_argument, NULL, 'f'},
+        {"shard", required_argument, NULL, 's'},
+        {"out", required_argument, NULL, 'o'},
+        {"merge", no_argument, NULL, 'm'},
+        {"auto", no_argument, NULL, 'a'},
+        {"phases", no_argument, NULL, 'p'},
+        {"budget", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "c:", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'c':
+                // -c TOL: stop each run once its IPC is known to within TOL (relative)
+                if (!parse_tolerance(optarg, tol))
+                    exit_on_error("Bad convergence tolerance (" + std::string(optarg) + ")");
+                have_tol = true;
+                break;
+            case 'f':
+                config_file = optarg;
+                break;
+            case 's':
+                if (sscanf(optarg, "%d/%d", &shard, &num_shards) != 2 ||
+                        num_shards < 1 || shard < 0 || shard >= num_shards)
+                    usage();
+                break;
+            case 'o':
+                out_file = optarg;
+                break;
+            case 'm':
+                merging = true;
+                break;
+            case 'a':
+                narrow = true;
+                break;
+            case 'p':
+                phases = true;
+                break;
+            case 'b':
+                budget = optarg;
+                break;
+            default:
+                usage();
         }
+    }
 
-        // Find the best pipeline configuration
-        std::sort(candidates.begin(), candidates.end(), [](const PipelineRun& pr1, const PipelineRun& pr2) {
-            return (pr1.J + pr1.K + pr1.L + pr1.R) < (pr2.J + pr2.K + pr2.L + pr2.R);
-        });
+    if (merging) {
+        if (optind >= argc)
+            usage();
 
-        // Best configuration
-        PipelineRun& pr = candidates[0];
+        merge(std::vector<std::string>(argv + optind, argv + argc));
+        return 0;
+    }
 
-        outfile << std::endl << "* Cheapest Configuration" << std::endl;
-        outfile << "- F: " << pr.F << " J: " << pr.J << " K: " << pr.K;
-        outfile << " L: " << pr.L << " R: " << pr.R << std::endl;
-        outfile << "--- Prediction accuracy: " << pr.prediction_accuracy*100 << "%" << std::endl;
-        outfile << "--- Best IPC: " << best_ipc << ", Found IPC: " << pr.ipc << " (" << (pr.ipc / best_ipc)*100 << "%)" << std::endl;
+    std::string err;
+    if (!config_file.empty() && !load_sweep(config_file, sweep, err))
+        exit_on_error(err);
+
+    if (have_tol)
+        sweep.converge_tol = tol;
+
+    if (!check_sweep(sweep, err))
+        exit_on_error(err);
+
+    if (!budget.empty() && !parse_budget(budget, sweep))
+        usage();
+
+    if (sweep.configs() == 0)
+        exit_on_error("Sweep has no configurations");
+
+    if (narrow)
+        narrow_sweep(sweep);
+
+    bool budgeted = sweep.budget_instructions > 0 || sweep.budget_seconds > 0;
+
+    if (phases) {
+        if (shard >= 0 || budgeted)
+            exit_on_error("--phases can't be combined with --shard or a budget");
+
+        run_phases(sweep);
+        return 0;
+    }
+
+    if (budgeted) {
+        if (shard >= 0)
+            exit_on_error("A budgeted sweep can't be sharded");
+
+        run_budgeted(sweep);
+        return 0;
+    }
+
+    if (shard >= 0) {
+        if (out_file.empty())
+            out_file = "procopt.part." + std::to_string(shard) + "of" + std::to_string(num_shards);
+
+        run_shard(sweep, shard, num_shards, out_file);
+        std::cout << "Partial results written to " << out_file << std::endl;
+        return 0;
+    }
+
+    std::ofstream outfile ("procopt.out");
+    std::ofstream full_data ("procopt.full.out");
+
+    for (std::string& trace: sweep.traces) {
+        std::vector<Instruction> instructions;
+        parse_trace(trace, instructions);
+
+        std::cout << "Optimizing " << trace << std::endl;
+
+        std::vector<PipelineRun> results;
+        results.reserve(sweep.configs());
+
+        std::unique_ptr<Pipeline> last;
+        uint64_t cycles = 0, resumed = 0;
+
+        for (size_t i = 0; i < sweep.configs(); i++) {
+            results.push_back(simulate(instructions, config_at(sweep, i), sweep.resume, last));
+            cycles += results.back().cycles;
+            resumed += results.back().resumed;
+        }
 
-        outfile << "====================================================" << std::endl << std::endl;
+        write_report(trace, results, outfile, full_data);
 
-        full_data << "====================================================" << std::endl;
+        if (resumed > 0)
+            std::cout << "Resumed " << resumed * 100 / cycles << "% of simulated cycles from neighbouring configs" << std::endl;
 
         std::cout << "Trace " << trace << " completed." << std::endl;
     }
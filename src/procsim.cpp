@@ -3,9 +3,50 @@
 #include <vector>
 #include <sstream>
 
+#include "analyze.hpp"
 #include "pipeline.hpp"
+#include "pipeview.hpp"
+#include "profile.hpp"
+#include "trace_cache.hpp"
 #include "util.hpp"
 
+// Returns where two runs of the same trace disagree, or "" if they don't
+static std::string compare_runs(const Pipeline& a, const Pipeline& b) {
+    const InstStatus& x = a.status;
+    const InstStatus& y = b.status;
+
+    if (x.size() != y.size())
+        return "instruction count";
+
+    for (size_t i = 0; i < x.size(); i++) {
+        if (x.fetch[i] != y.fetch[i] || x.disp[i] != y.disp[i] || x.sched[i] != y.sched[i] ||
+            x.exec[i] != y.exec[i] || x.state[i] != y.state[i] || x.stage[i] != y.stage[i])
+            return "instruction " + std::to_string(i + 1);
+    }
+
+    if (x.epochs != y.epochs)
+        return "cycle epochs";
+
+    const Stats& s = a.proc_stats;
+    const Stats& t = b.proc_stats;
+
+    if (s.total_branches != t.total_branches || s.correct_branches != t.correct_branches)
+        return "branch counts";
+    if (s.avg_disp_size != t.avg_disp_size || s.max_disp_size != t.max_disp_size)
+        return "dispatch queue size";
+    if (s.avg_inst_issue != t.avg_inst_issue || s.avg_inst_retired != t.avg_inst_retired)
+        return "issue/retire rate";
+    if (s.cycle_count != t.cycle_count)
+        return "cycle count";
+
+    for (int c = 0; c < NUM_STALL_CAUSES; c++) {
+        if (s.stall_cycles[c] != t.stall_cycles[c])
+            return std::string("CPI stack (") + stall_cause_name(c) + ")";
+    }
+
+    return "";
+}
+
 int main(int argc, char** argv) {
     // Unbuffered output
     std::cout.setf(std::ios::unitbuf);
@@ -17,12 +58,46 @@ int main(int argc, char** argv) {
     // Output results file
     std::string output_file = inputargs.trace_file + ".out";
 
-    // Parse trace lines and store data in a vector of Instruction
+    // Parse trace lines and store data in a vector of Instruction, or
+    // attach to a copy another procsim process already published
     std::vector<Instruction> instructions;
-    parse_trace(inputargs.trace_file, instructions);
+    SharedTrace shared;
+    TraceView trace;
+    std::string err;
+
+    if (inputargs.shm_cache && !shared.open(inputargs.trace_file, err))
+        std::cout << "* Shared trace cache unavailable (" << err << "); parsing privately" << std::endl;
+
+    if (shared.is_open()) {
+        trace = shared.view();
+
+        if (shared.published())
+            std::cout << "* Published trace to shared cache" << std::endl;
+        else
+            std::cout << "* Attached to shared trace cache" << std::endl;
+    } else {
+        parse_trace(inputargs.trace_file, instructions);
+        trace = instructions;
+    }
 
     std::cout << "* Input file: " << inputargs.trace_file << std::endl;
-    std::cout << "*** " << instructions.size() << " instructions read from trace file" << std::endl;
+    std::cout << "*** " << trace.size() << " instructions read from trace file" << std::endl;
+
+    if (inputargs.analyze) {
+        TraceAnalysis analysis;
+        analyze_trace(trace, analysis);
+
+        std::string analysis_file = inputargs.trace_file + ".analysis";
+        std::ofstream out (analysis_file);
+        write_analysis(out, analysis);
+        out.close();
+
+        std::cout << std::endl;
+        write_analysis(std::cout, analysis);
+        std::cout << std::endl << "* Analysis written to: " << analysis_file << std::endl;
+        return 0;
+    }
+
     std::cout << "* Pipeline started; please wait for results" << std::endl;
 
     // Setup pipeline options
@@ -31,13 +106,63 @@ int main(int argc, char** argv) {
         .J = inputargs.J,
         .K = inputargs.K,
         .L = inputargs.L,
-        .R = inputargs.R
+        .R = inputargs.R,
+        .converge_tol = inputargs.converge_tol
     };
 
+    if (!inputargs.mem_spec.empty() && !parse_memory_spec(inputargs.mem_spec, opt.mem, err))
+        exit_on_error(err);
+
+    opt.fetch_q_size = inputargs.fetch_q_size;
+    opt.disp_q_size = inputargs.disp_q_size;
+    opt.memo = inputargs.memo > 0;
+
+    for (int t = 0; t < 3; t++) {
+        opt.latency[t] = inputargs.latency[t];
+        opt.pipelined[t] = inputargs.pipelined[t];
+    }
+
     // Create a new pipeline
-    Pipeline p (instructions, opt);
+    Pipeline p (trace, opt);
+
+    HotspotProfile profile;
+    if (inputargs.profile_top > 0)
+        p.profile = &profile;
+
+    // Pipeline viewer log, written alongside the simulation
+    PipeViewWriter pipeview;
+    std::string view_file = inputargs.trace_file + ".kanata";
+
+    if (inputargs.view_first > 0) {
+        if (!pipeview.open(view_file, trace, inputargs.view_first - 1, inputargs.view_last - 1, err))
+            exit_on_error(err);
+
+        p.pipeview = &pipeview;
+    }
 
     p.start();
+    pipeview.close();
+
+    if (inputargs.view_first > 0)
+        std::cout << "* Pipeline view written to: " << view_file << std::endl;
+
+    if (opt.memo)
+        std::cout << "* Cycles replayed from repeated loop periods: " << p.proc_stats.memo_cycles << std::endl;
+
+    // Memoisation must not change anything; check against a full simulation
+    if (inputargs.memo == 2) {
+        PipelineOptions full_opt = opt;
+        full_opt.memo = false;
+
+        Pipeline full (trace, full_opt);
+        full.start();
+
+        std::string diff = compare_runs(p, full);
+        if (!diff.empty())
+            exit_on_error("Memoised run differs from full simulation: " + diff);
+
+        std::cout << "* Memoised run matches full simulation" << std::endl;
+    }
 
     std::ofstream output (output_file);
 
@@ -52,13 +177,17 @@ int main(int argc, char** argv) {
     output << "INST  " << "FETCH  " << "DISP  " << "SCHED  " << "EXEC  " << "STATE  " << std::endl;
 
     // Cycle-by-cycle results
-    for (InstStatus& is: p.status) {
-        output << is.idx+1 << " ";
-        output << is.fetch+1 << " ";
-        output << is.disp+1 << " ";
-        output << is.sched+1 << " ";
-        output << is.exec+1 << " ";
-        output << is.state+1 << std::endl;
+    InstStatus& is = p.status;
+
+    for (size_t i = 0; i < is.size(); i++) {
+        uint64_t fetched = is.fetch_cycle(i);
+
+        output << i+1 << " ";
+        output << fetched+1 << " ";
+        output << is.cycle(is.disp, i, fetched)+1 << " ";
+        output << is.cycle(is.sched, i, fetched)+1 << " ";
+        output << is.cycle(is.exec, i, fetched)+1 << " ";
+        output << is.cycle(is.state, i, fetched)+1 << std::endl;
     }
 
     Stats proc_stats = p.proc_stats;
@@ -77,6 +206,26 @@ int main(int argc, char** argv) {
     output << "Avg inst retired per cycle: " << proc_stats.avg_inst_retired << std::endl;
     output << "Total run time (cycles): " << proc_stats.cycle_count << std::endl;
 
+    if (opt.mem.enabled) {
+        output << "L1 hits/misses: " << proc_stats.l1_hits << "/" << proc_stats.l1_misses << std::endl;
+        output << "L2 hits/misses: " << proc_stats.l2_hits << "/" << proc_stats.l2_misses << std::endl;
+    }
+
+    if (opt.converge_tol > 0) {
+        output << "Estimated IPC: " << proc_stats.avg_inst_retired << " +/- " << proc_stats.ipc_error << std::endl;
+        output << "Instructions simulated: " << proc_stats.simulated_instructions;
+        output << (proc_stats.converged ? " (converged early)" : " (whole trace)") << std::endl;
+    }
+
+    output << std::endl << "CPI stack:" << std::endl;
+    for (int c = 0; c < NUM_STALL_CAUSES; c++)
+        output << stall_cause_name(c) << ": " << proc_stats.cpi_stack[c] << std::endl;
+
+    if (inputargs.profile_top > 0) {
+        output << std::endl;
+        profile.write(output, inputargs.profile_top);
+    }
+
     std::cout << "* Results written to: " << output_file << std::endl;
 
     output.close();
@@ -93,5 +242,20 @@ int main(int argc, char** argv) {
     std::cout << "Avg inst retired per cycle: " << proc_stats.avg_inst_retired << std::endl;
     std::cout << "Total run time (cycles): " << proc_stats.cycle_count << std::endl;
 
+    if (opt.mem.enabled) {
+        std::cout << "L1 hits/misses: " << proc_stats.l1_hits << "/" << proc_stats.l1_misses << std::endl;
+        std::cout << "L2 hits/misses: " << proc_stats.l2_hits << "/" << proc_stats.l2_misses << std::endl;
+    }
+
+    if (opt.converge_tol > 0) {
+        std::cout << "Estimated IPC: " << proc_stats.avg_inst_retired << " +/- " << proc_stats.ipc_error << std::endl;
+        std::cout << "Instructions simulated: " << proc_stats.simulated_instructions;
+        std::cout << (proc_stats.converged ? " (converged early)" : " (whole trace)") << std::endl;
+    }
+
+    std::cout << std::endl << "CPI stack:" << std::endl;
+    for (int c = 0; c < NUM_STALL_CAUSES; c++)
+        std::cout << stall_cause_name(c) << ": " << proc_stats.cpi_stack[c] << std::endl;
+
     return 0;
 }
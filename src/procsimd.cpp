@@ -0,0 +1,534 @@
+/*
+ * procsimd: simulation daemon
+ *
+ * Keeps parsed traces resident and runs jobs from clients connected over a
+ * local Unix domain socket. The protocol is line based; every request is one
+ * line and every response starts with OK, ERR or an event keyword.
+ *
+ *   LOAD <trace_id> <path>                   -> OK <trace_id> <instructions>
+ *   UNLOAD <trace_id>                        -> OK
+ *   RUN <trace_id> <F> <J> <K> <L> <R> [tol] -> QUEUED <job_id>
+ *                                               ... DONE <job_id> <stats>
+ *                                               ... CANCELLED <job_id>
+ *                                               ... ERR job <job_id> not run: ...
+ *   CANCEL <job_id>                          -> OK
+ *   STATUS                                   -> OK queued=<n> running=<n> traces=<n>
+ *   QUIT                                     (closes the connection)
+ *   SHUTDOWN                                 (stops the daemon)
+ *
+ * DONE and CANCELLED lines arrive asynchronously on the connection that
+ * submitted the job, in completion order.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pipeline.hpp"
+#include "procsim.hpp"
+#include "util.hpp"
+
+typedef std::shared_ptr<const std::vector<Instruction>> TracePtr;
+
+// How long a closing connection gets to take a reply already being sent
+static const int CLOSE_GRACE_MS = 200;
+
+// One client connection; lines may be sent from any thread. They queue up
+// in order and a writer thread per client puts them on the socket, so a
+// client that stops reading holds up nobody else. The socket is closed once
+// the session and all of its jobs have let go of the Client.
+struct Client {
+    int fd;
+
+    Client(int fd) : fd(fd), writer(&Client::drain, this) {}
+
+    ~Client() {
+        {
+            std::unique_lock<std::mutex> lock (write_lock);
+            closing = true;
+            queued.notify_one();
+
+            // A client that stopped reading can leave the writer blocked
+            // in send(); shutting the socket down makes that send fail
+            if (!drained.wait_for(lock, std::chrono::milliseconds(CLOSE_GRACE_MS),
+                                  [this] { return outbox.empty() && !writing; }))
+                ::shutdown(fd, SHUT_RDWR);
+        }
+
+        writer.join();
+        close(fd);
+    }
+
+    void send(const std::string& line) {
+        std::lock_guard<std::mutex> lock (write_lock);
+        outbox.push_back(line + "\n");
+        queued.notify_one();
+    }
+
+    // Wait until every line sent so far is on the socket (or dropped)
+    void flush() {
+        std::unique_lock<std::mutex> lock (write_lock);
+        drained.wait(lock, [this] { return outbox.empty() && !writing; });
+    }
+
+private:
+    std::mutex write_lock;
+    std::condition_variable queued, drained;
+    std::deque<std::string> outbox;
+    bool writing = false; // The writer holds a line it took from outbox
+    bool closing = false; // Deliver what's left without waiting, then stop
+    bool gone = false; // Client went away; drop the rest
+    std::thread writer;
+
+    void drain() {
+        std::unique_lock<std::mutex> lock (write_lock);
+
+        while (true) {
+            queued.wait(lock, [this] { return closing || !outbox.empty(); });
+
+            if (outbox.empty())
+                return;
+
+            std::string msg = outbox.front();
+            outbox.pop_front();
+            writing = true;
+            int flags = MSG_NOSIGNAL | (closing ? MSG_DONTWAIT : 0);
+            lock.unlock();
+
+            const char* p = msg.c_str();
+            size_t left = gone ? 0 : msg.size();
+
+            while (left > 0) {
+                ssize_t n = ::send(fd, p, left, flags);
+                if (n <= 0) {
+                    gone = true;
+                    break;
+                }
+                p += n;
+                left -= n;
+            }
+
+            lock.lock();
+            writing = false;
+            drained.notify_all();
+        }
+    }
+};
+
+struct Job {
+    uint64_t id;
+    TracePtr trace;
+    PipelineOptions opt;
+    std::shared_ptr<Client> client;
+    std::atomic<bool> cancel;
+};
+
+class Daemon {
+public:
+    Daemon(int workers) : num_workers(workers) {}
+
+    void start_workers();
+    void stop();
+    void serve(std::shared_ptr<Client> client);
+
+    // Handle one request line; returns the reply, or "" if already sent
+    std::string handle(const std::string& line, std::shared_ptr<Client> client);
+
+    std::atomic<bool> shutdown {false};
+    std::atomic<int> sessions {0};
+
+private:
+    int num_workers;
+    std::vector<std::thread> workers;
+
+    std::mutex lock;
+    std::condition_variable work_ready;
+    std::deque<std::shared_ptr<Job>> queue;
+    std::map<uint64_t, std::shared_ptr<Job>> running;
+    std::map<std::string, TracePtr> traces;
+    uint64_t next_job = 0;
+
+    void worker();
+};
+
+static std::string format_stats(uint64_t job, const Stats& s) {
+    std::ostringstream out;
+    out.precision(8);
+    out << "DONE " << job;
+    out << " cycles=" << s.cycle_count;
+    out << " instructions=" << s.total_instructions;
+    out << " ipc=" << s.avg_inst_retired;
+    out << " issue=" << s.avg_inst_issue;
+    out << " branches=" << s.total_branches;
+    out << " correct=" << s.correct_branches;
+    out << " accuracy=" << s.prediction_accuracy;
+    out << " avg_disp=" << s.avg_disp_size;
+    out << " max_disp=" << s.max_disp_size;
+    out << " simulated=" << s.simulated_instructions;
+    out << " converged=" << (s.converged ? 1 : 0);
+    out << " ipc_error=" << s.ipc_error;
+
+    for (int c = 0; c < NUM_STALL_CAUSES; c++)
+        out << " cpi_" << stall_cause_name(c) << "=" << s.cpi_stack[c];
+    return out.str();
+}
+
+void Daemon::start_workers() {
+    for (int i = 0; i < num_workers; i++)
+        workers.push_back(std::thread(&Daemon::worker, this));
+}
+
+void Daemon::stop() {
+    std::deque<std::shared_ptr<Job>> dropped;
+
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        shutdown = true;
+        dropped.swap(queue);
+
+        for (auto& kv: running)
+            kv.second->cancel = true;
+    }
+
+    work_ready.notify_all();
+
+    // Jobs that never started get an answer too
+    for (std::shared_ptr<Job>& job: dropped) {
+        job->client->send("ERR job " + std::to_string(job->id) + " not run: daemon shutting down");
+    }
+
+    for (std::thread& t: workers)
+        t.join();
+}
+
+void Daemon::worker() {
+    while (true) {
+        std::shared_ptr<Job> job;
+
+        {
+            std::unique_lock<std::mutex> guard (lock);
+            work_ready.wait(guard, [this] { return shutdown || !queue.empty(); });
+
+            if (shutdown)
+                return;
+
+            job = queue.front();
+            queue.pop_front();
+            running[job->id] = job;
+        }
+
+        Pipeline p (*job->trace, job->opt);
+        p.cancel = &job->cancel;
+        p.start();
+
+        {
+            std::lock_guard<std::mutex> guard (lock);
+            running.erase(job->id);
+        }
+
+        if (p.cancelled)
+            job->client->send("CANCELLED " + std::to_string(job->id));
+        else
+            job->client->send(format_stats(job->id, p.proc_stats));
+    }
+}
+
+std::string Daemon::handle(const std::string& line, std::shared_ptr<Client> client) {
+    std::istringstream iss (line);
+    std::string cmd;
+    iss >> cmd;
+
+    if (cmd == "LOAD") {
+        std::string id, path, err;
+        iss >> id >> path;
+
+        if (id.empty() || path.empty())
+            return "ERR usage: LOAD <trace_id> <path>";
+
+        // Parse outside the lock; other clients keep running meanwhile
+        std::shared_ptr<std::vector<Instruction>> ins = std::make_shared<std::vector<Instruction>>();
+
+        if (!load_trace(path, *ins, err))
+            return "ERR " + err;
+
+        std::lock_guard<std::mutex> guard (lock);
+        traces[id] = ins;
+        return "OK " + id + " " + std::to_string(ins->size());
+    }
+
+    if (cmd == "UNLOAD") {
+        std::string id;
+        iss >> id;
+
+        // Jobs already queued hold their own reference to the trace
+        std::lock_guard<std::mutex> guard (lock);
+        if (traces.erase(id) == 0)
+            return "ERR unknown trace " + id;
+        return "OK";
+    }
+
+    if (cmd == "RUN") {
+        std::string id, err;
+        PipelineOptions opt = {};
+        iss >> id >> opt.F >> opt.J >> opt.K >> opt.L >> opt.R;
+
+        if (iss.fail())
+            return "ERR usage: RUN <trace_id> <F> <J> <K> <L> <R> [tol]";
+
+        // Optional convergence tolerance for early termination
+        std::string tol;
+        if (iss >> tol) {
+            char* end = NULL;
+            opt.converge_tol = strtod(tol.c_str(), &end);
+
+            if (*end != '\0' || end == tol.c_str() || opt.converge_tol < 0)
+                return "ERR bad tolerance " + tol;
+        }
+
+        if (iss >> tol)
+            return "ERR usage: RUN <trace_id> <F> <J> <K> <L> <R> [tol]";
+
+        if (!validate_options(opt, err))
+            return "ERR " + err;
+
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        job->opt = opt;
+        job->client = client;
+        job->cancel = false;
+
+        {
+            std::lock_guard<std::mutex> guard (lock);
+
+            auto it = traces.find(id);
+            if (it == traces.end())
+                return "ERR unknown trace " + id;
+
+            if (it->second->empty())
+                return "ERR trace " + id + " is empty";
+
+            job->trace = it->second;
+            job->id = next_job++;
+            queue.push_back(job);
+
+            // Reply before a worker can possibly answer with DONE
+            client->send("QUEUED " + std::to_string(job->id));
+        }
+
+        work_ready.notify_one();
+        return "";
+    }
+
+    if (cmd == "CANCEL") {
+        uint64_t id;
+        iss >> id;
+
+        if (iss.fail())
+            return "ERR usage: CANCEL <job_id>";
+
+        std::shared_ptr<Job> job;
+
+        {
+            std::lock_guard<std::mutex> guard (lock);
+
+            for (auto it = queue.begin(); it != queue.end(); ++it) {
+                if ((*it)->id == id) {
+                    job = *it;
+                    queue.erase(it);
+                    break;
+                }
+            }
+
+            if (!job) {
+                // Running jobs stop at their next poll and report CANCELLED then
+                auto it = running.find(id);
+                if (it == running.end())
+                    return "ERR unknown job " + std::to_string(id);
+
+                it->second->cancel = true;
+                return "OK";
+            }
+        }
+
+        job->client->send("CANCELLED " + std::to_string(id));
+        return "OK";
+    }
+
+    if (cmd == "STATUS") {
+        std::lock_guard<std::mutex> guard (lock);
+        std::ostringstream out;
+        out << "OK queued=" << queue.size() << " running=" << running.size();
+        out << " traces=" << traces.size() << " workers=" << num_workers;
+        return out.str();
+    }
+
+    return "ERR unknown command " + cmd;
+}
+
+void Daemon::serve(std::shared_ptr<Client> client) {
+    std::string buf;
+    char chunk[4096];
+    bool done = false;
+
+    while (!done && !shutdown) {
+        ssize_t n = recv(client->fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            break;
+
+        buf.append(chunk, n);
+
+        size_t pos;
+        while (!done && (pos = buf.find('\n')) != std::string::npos) {
+            std::string line = buf.substr(0, pos);
+            buf.erase(0, pos + 1);
+
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+
+            if (line.empty())
+                continue;
+
+            if (line == "QUIT") {
+                done = true;
+            } else if (line == "SHUTDOWN") {
+                client->send("OK");
+                client->flush();
+                shutdown = true;
+                done = true;
+            } else {
+                std::string reply = handle(line, client);
+                if (!reply.empty())
+                    client->send(reply);
+            }
+        }
+    }
+
+    // Stop reading; results of jobs still queued are still delivered
+    ::shutdown(client->fd, SHUT_RD);
+    sessions--;
+}
+
+static void print_usage() {
+    std::cout << "Usage: ./procsimd -s <socket_path> [-w workers] [-t id=trace_file]..." << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    std::string socket_path;
+    int workers = static_cast<int>(std::thread::hardware_concurrency());
+    std::vector<std::string> preload;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:w:t:")) != -1) {
+        switch (c) {
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'w':
+                workers = static_cast<int>(strtol(optarg, NULL, 10));
+                break;
+            case 't':
+                preload.push_back(optarg);
+                break;
+            default:
+                print_usage();
+        }
+    }
+
+    if (socket_path.empty() || workers < 1)
+        print_usage();
+
+    if (socket_path.size() >= sizeof(sockaddr_un::sun_path))
+        exit_on_error("Socket path too long");
+
+    // A vanished client must not take the daemon down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    Daemon d (workers);
+
+    for (std::string& t: preload) {
+        size_t eq = t.find('=');
+        if (eq == std::string::npos)
+            print_usage();
+
+        std::string reply = d.handle("LOAD " + t.substr(0, eq) + " " + t.substr(eq + 1), nullptr);
+        std::cout << reply << std::endl;
+
+        if (reply.compare(0, 2, "OK") != 0)
+            exit(EXIT_FAILURE);
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1)
+        exit_on_error("Unable to create socket");
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // Replace a stale socket left behind by a previous instance
+    unlink(socket_path.c_str());
+
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+        exit_on_error("Unable to bind " + socket_path + " (" + strerror(errno) + ")");
+
+    if (listen(listen_fd, 64) == -1)
+        exit_on_error("Unable to listen on " + socket_path);
+
+    d.start_workers();
+
+    std::cout << "* procsimd listening on " << socket_path << " with " << workers << " workers" << std::endl;
+
+    std::vector<std::weak_ptr<Client>> clients;
+
+    while (!d.shutdown) {
+        // Wake up regularly to notice a SHUTDOWN from a client
+        pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+
+        std::shared_ptr<Client> client = std::make_shared<Client>(fd);
+        clients.push_back(client);
+
+        d.sessions++;
+        std::thread(&Daemon::serve, &d, client).detach();
+    }
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+
+    // Cancel running jobs, then unblock sessions still waiting on input.
+    // Only the read side is shut, so the last replies are still written.
+    d.stop();
+
+    for (std::weak_ptr<Client>& w: clients) {
+        std::shared_ptr<Client> client = w.lock();
+        if (client)
+            ::shutdown(client->fd, SHUT_RD);
+    }
+
+    while (d.sessions > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::cout << "* procsimd stopped" << std::endl;
+
+    return 0;
+}
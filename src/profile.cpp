@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "profile.hpp"
+
+// Fibonacci hashing of the word address; trace addresses are 4-byte aligned
+static inline size_t hash_addr(int64_t addr) {
+    return static_cast<size_t>((static_cast<uint64_t>(addr) >> 2) * 0x9E3779B97F4A7C15ULL >> 32);
+}
+
+HotspotProfile::HotspotProfile(size_t capacity) {
+    size_t size = 16;
+    while (size < capacity)
+        size <<= 1;
+
+    table.resize(size);
+    used.resize(size, false);
+    mask = size - 1;
+}
+
+HotspotEntry& HotspotProfile::find(int64_t addr) {
+    size_t i = hash_addr(addr) & mask;
+
+    while (used[i]) {
+        if (table[i].addr == addr)
+            return table[i];
+        i = (i + 1) & mask;
+    }
+
+    // Keep the load factor under 1/2 so probe sequences stay short
+    if (2 * (entries + 1) > table.size()) {
+        grow();
+        return find(addr);
+    }
+
+    used[i] = true;
+    table[i] = {};
+    table[i].addr = addr;
+    entries++;
+
+    return table[i];
+}
+
+void HotspotProfile::grow() {
+    std::vector<HotspotEntry> old_table;
+    std::vector<bool> old_used;
+    old_table.swap(table);
+    old_used.swap(used);
+
+    table.resize(old_table.size() * 2);
+    used.resize(old_table.size() * 2, false);
+    mask = table.size() - 1;
+
+    for (size_t i = 0; i < old_table.size(); i++) {
+        if (!old_used[i])
+            continue;
+
+        size_t j = hash_addr(old_table[i].addr) & mask;
+        while (used[j])
+            j = (j + 1) & mask;
+
+        used[j] = true;
+        table[j] = old_table[i];
+    }
+}
+
+void HotspotProfile::record(int64_t addr, uint32_t disp_wait, uint32_t sched_wait, uint32_t exec) {
+    HotspotEntry& e = find(addr);
+    e.count++;
+    e.disp_wait += disp_wait;
+    e.sched_wait += sched_wait;
+    e.exec += exec;
+}
+
+void HotspotProfile::record_mispredict(int64_t addr) {
+    find(addr).mispredicts++;
+}
+
+std::vector<HotspotEntry> HotspotProfile::top(size_t n) const {
+    std::vector<HotspotEntry> all;
+    all.reserve(entries);
+
+    for (size_t i = 0; i < table.size(); i++) {
+        if (used[i])
+            all.push_back(table[i]);
+    }
+
+    n = std::min(n, all.size());
+
+    std::partial_sort(all.begin(), all.begin() + n, all.end(), [](const HotspotEntry& e1, const HotspotEntry& e2) {
+        if (e1.total_cycles() == e2.total_cycles())
+            return e1.addr < e2.addr;
+        else
+            return e1.total_cycles() > e2.total_cycles();
+    });
+
+    all.resize(n);
+    return all;
+}
+
+void HotspotProfile::write(std::ostream& out, size_t n) const {
+    std::vector<HotspotEntry> hot = top(n);
+
+    out << "Hotspots (top " << hot.size() << " of " << entries << " static instructions by total cycles):" << std::endl;
+    out << "ADDR  COUNT  MISPRED  CYCLES  AVG_DISP  AVG_SCHED  AVG_EXEC" << std::endl;
+
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(2);
+
+    for (HotspotEntry& e: hot) {
+        double count = static_cast<double>(e.count);
+
+        out << std::hex << static_cast<uint64_t>(e.addr) << std::dec << " ";
+        out << e.count << " " << e.mispredicts << " " << e.total_cycles() << " ";
+
+        if (e.count == 0) {
+            out << "- - -" << std::endl;
+            continue;
+        }
+
+        out << e.disp_wait / count << " ";
+        out << e.sched_wait / count << " ";
+        out << e.exec / count << std::endl;
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
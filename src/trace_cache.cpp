@@ -0,0 +1,333 @@
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace_cache.hpp"
+#include "util.hpp"
+
+// Instructions start one page into the segment so they can be mapped
+// read-only separately from the writable header
+static const size_t DATA_OFFSET = 4096;
+
+static const uint32_t CACHE_MAGIC = 0x70726373; // "prcs"
+
+// How often and how long to retry while another process is busy with the segment
+static const int RETRY_SLEEP_MS = 2;
+static const int MAX_RETRIES = 1000;
+
+enum SegmentState : uint32_t {
+    BUILDING,
+    READY,
+    FAILED // Publisher gave up; the segment is unlinked
+};
+
+struct SharedTrace::Header {
+    uint32_t magic;
+    uint32_t inst_size; // sizeof(Instruction) of the publisher
+    std::atomic<uint32_t> state;
+    std::atomic<int32_t> refs;
+    int32_t owner; // pid of the publishing process
+    uint64_t file_size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t count;
+};
+
+static std::string segment_name(const std::string& path) {
+    // FNV-1a of the canonical path keeps names short and free of '/'
+    uint64_t h = 1469598103934665603ULL;
+
+    for (char c: path) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ULL;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "/procsim.%016llx", static_cast<unsigned long long>(h));
+    return buf;
+}
+
+// Modification time of a stat result; macOS names the field differently
+static const struct timespec& modified(const struct stat& sb) {
+#ifdef __APPLE__
+    return sb.st_mtimespec;
+#else
+    return sb.st_mtim;
+#endif
+}
+
+// Whether the segment name still refers to the segment behind fd
+static bool is_linked(const std::string& name, int fd) {
+    struct stat ours, current;
+    int cur = shm_open(name.c_str(), O_RDONLY, 0);
+
+    if (cur == -1)
+        return false;
+
+    bool same = fstat(fd, &ours) == 0 && fstat(cur, &current) == 0 && ours.st_ino == current.st_ino;
+    ::close(cur);
+    return same;
+}
+
+// Remove the segment name, but only if it still refers to the segment behind fd
+static void unlink_if_same(const std::string& name, int fd) {
+    if (is_linked(name, fd))
+        shm_unlink(name.c_str());
+}
+
+static inline void retry_sleep() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_SLEEP_MS));
+}
+
+SharedTrace::~SharedTrace() {
+    close();
+}
+
+TraceView SharedTrace::view() const {
+    return TraceView(data, count);
+}
+
+bool SharedTrace::open(const std::string& file, std::string& err) {
+    close();
+
+    char resolved[PATH_MAX];
+    if (realpath(file.c_str(), resolved) == NULL) {
+        err = "Unable to open trace file specified (" + file + ")";
+        return false;
+    }
+
+    struct stat sb;
+    if (stat(resolved, &sb) == -1) {
+        err = "Unable to stat trace file (" + file + ")";
+        return false;
+    }
+
+    name = segment_name(resolved);
+
+    for (int i = 0; i < MAX_RETRIES; i++) {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+        if (fd != -1)
+            return publish(resolved, sb, err);
+
+        if (errno != EEXIST) {
+            err = "Unable to create shared segment " + name + " (" + strerror(errno) + ")";
+            return false;
+        }
+
+        fd = shm_open(name.c_str(), O_RDWR, 0);
+
+        if (fd == -1) {
+            // Removed between our two opens; try creating it again
+            retry_sleep();
+            continue;
+        }
+
+        bool retry = false;
+
+        if (attach(sb, retry, err))
+            return true;
+
+        unmap();
+
+        if (!retry)
+            return false;
+
+        retry_sleep();
+    }
+
+    err = "Timed out waiting for shared segment " + name;
+    return false;
+}
+
+bool SharedTrace::publish(const std::string& file, const struct stat& sb, std::string& err) {
+    // Make the header visible first so others can wait on it
+    if (ftruncate(fd, DATA_OFFSET) == -1) {
+        err = "Unable to size shared segment (" + std::string(strerror(errno)) + ")";
+        shm_unlink(name.c_str());
+        unmap();
+        return false;
+    }
+
+    void* h = mmap(NULL, DATA_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (h == MAP_FAILED) {
+        err = "Unable to map shared segment";
+        shm_unlink(name.c_str());
+        unmap();
+        return false;
+    }
+
+    header = static_cast<Header*>(h);
+    header->inst_size = sizeof(Instruction);
+    header->state = BUILDING;
+    header->refs = 0;
+    header->owner = getpid();
+    header->file_size = sb.st_size;
+    header->mtime_sec = modified(sb).tv_sec;
+    header->mtime_nsec = modified(sb).tv_nsec;
+    header->count = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = CACHE_MAGIC;
+
+    std::vector<Instruction> ins;
+
+    if (!load_trace(file, ins, err)) {
+        fail_publish();
+        return false;
+    }
+
+    size_t bytes = ins.size() * sizeof(Instruction);
+
+    if (ftruncate(fd, DATA_OFFSET + bytes) == -1) {
+        err = "Unable to size shared segment (" + std::string(strerror(errno)) + ")";
+        fail_publish();
+        return false;
+    }
+
+    if (bytes > 0) {
+        void* d = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, DATA_OFFSET);
+
+        if (d == MAP_FAILED) {
+            err = "Unable to map shared segment";
+            fail_publish();
+            return false;
+        }
+
+        memcpy(d, ins.data(), bytes);
+
+        // From here on the data is read-only for everyone, us included
+        mprotect(d, bytes, PROT_READ);
+        data = static_cast<const Instruction*>(d);
+    }
+
+    count = ins.size();
+    header->count = count;
+    header->refs = 1;
+    header->state.store(READY, std::memory_order_release);
+    publisher = true;
+    referenced = true;
+
+    return true;
+}
+
+void SharedTrace::fail_publish() {
+    // Tell processes already waiting on the header before the name goes
+    header->state.store(FAILED, std::memory_order_release);
+    shm_unlink(name.c_str());
+    unmap();
+}
+
+bool SharedTrace::attach(const struct stat& sb, bool& retry, std::string& err) {
+    struct stat seg;
+
+    // Publisher hasn't sized the segment yet
+    if (fstat(fd, &seg) == -1 || static_cast<size_t>(seg.st_size) < DATA_OFFSET) {
+        retry = true;
+        return false;
+    }
+
+    void* h = mmap(NULL, DATA_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (h == MAP_FAILED) {
+        err = "Unable to map shared segment";
+        return false;
+    }
+
+    header = static_cast<Header*>(h);
+
+    // Wait for the publisher to finish, taking over if it died. A publisher
+    // that gave up before its header was set up has at least unlinked the
+    // segment, so start over then.
+    for (uint32_t state; (state = header->state.load(std::memory_order_acquire)) != READY; ) {
+        if (state == FAILED) {
+            err = "Another process failed to load the trace into " + name;
+            return false;
+        }
+
+        if (header->magic == CACHE_MAGIC && kill(header->owner, 0) == -1 && errno == ESRCH) {
+            unlink_if_same(name, fd);
+            retry = true;
+            return false;
+        }
+
+        if (!is_linked(name, fd)) {
+            retry = true;
+            return false;
+        }
+
+        retry_sleep();
+    }
+
+    // Built from a different version of the file, or by an incompatible build
+    if (header->inst_size != sizeof(Instruction) ||
+            header->file_size != static_cast<uint64_t>(sb.st_size) ||
+            header->mtime_sec != modified(sb).tv_sec ||
+            header->mtime_nsec != modified(sb).tv_nsec) {
+        unlink_if_same(name, fd);
+        retry = true;
+        return false;
+    }
+
+    // Take a reference, unless the last user is already tearing it down
+    int32_t refs = header->refs.load();
+
+    do {
+        if (refs <= 0) {
+            retry = true;
+            return false;
+        }
+    } while (!header->refs.compare_exchange_weak(refs, refs + 1));
+
+    referenced = true;
+    count = header->count;
+
+    if (count > 0) {
+        void* d = mmap(NULL, count * sizeof(Instruction), PROT_READ, MAP_SHARED, fd, DATA_OFFSET);
+
+        if (d == MAP_FAILED) {
+            err = "Unable to map shared segment";
+            close();
+            return false;
+        }
+
+        data = static_cast<const Instruction*>(d);
+    }
+
+    return true;
+}
+
+void SharedTrace::close() {
+    // Last one out removes the segment
+    if (referenced && header->refs.fetch_sub(1) == 1)
+        unlink_if_same(name, fd);
+
+    unmap();
+}
+
+void SharedTrace::unmap() {
+    if (data != NULL)
+        munmap(const_cast<Instruction*>(data), count * sizeof(Instruction));
+
+    if (header != NULL)
+        munmap(header, DATA_OFFSET);
+
+    if (fd != -1)
+        ::close(fd);
+
+    data = NULL;
+    header = NULL;
+    count = 0;
+    fd = -1;
+    publisher = false;
+    referenced = false;
+}
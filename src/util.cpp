@@ -1,12 +1,22 @@
+#include <algorithm>
 #include <iostream>
 #include <unistd.h>
+#include <getopt.h>
 #include <fstream>
 #include <sstream>
+#include <thread>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "util.hpp"
 
 void print_usage() {
-    std::cout << "Usage: ./procsim –r R –f F –j J –k K –l L -i <trace_file>" << std::endl;
+    std::cout << "Usage: ./procsim –r R –f F –j J –k K –l L -i <trace_file> [-s] [-p N] [-v FIRST:LAST] [-c TOL] [-m MEM] [-q FQ:DQ] [-x LAT] [-z | -Z]" << std::endl;
+    std::cout << "       ./procsim --analyze -i <trace_file>" << std::endl;
     exit(EXIT_FAILURE);
 }
 
@@ -16,23 +26,24 @@ void exit_on_error(const std::string& msg) {
 }
 
 void parse_args(int argc, char **argv, InputArgs& args) {
-    if (argc < 12)
-        print_usage();
-
-    // Variables for getopt()
+    // Variable for getopt()
     extern char *optarg;
-    extern int optind;
 
     // Args string for getopt()
-    static const char* ALLOWED_ARGS = "r:f:j:k:l:i:";
+    static const char* ALLOWED_ARGS = "r:f:j:k:l:i:sp:v:c:m:q:x:zZ";
+
+    static const struct option long_opts[] = {
+        {"analyze", no_argument, NULL, 'a'},
+        {NULL, 0, NULL, 0}
+    };
 
     int c;
     int num = 0;
 
     // Extract other parameters
-    while ((c = getopt(argc, argv, ALLOWED_ARGS)) != -1) {
+    while ((c = getopt_long(argc, argv, ALLOWED_ARGS, long_opts, NULL)) != -1) {
         // Stores converted arg from char* to int
-        num = static_cast<int>(strtol(optarg, NULL, 10));
+        num = optarg ? static_cast<int>(strtol(optarg, NULL, 10)) : 0;
 
         switch (c) {
             case 'r':
@@ -53,46 +64,344 @@ void parse_args(int argc, char **argv, InputArgs& args) {
             case 'i':
                 args.trace_file = optarg;
                 break;
+            case 's':
+                args.shm_cache = true;
+                break;
+            case 'p':
+                args.profile_top = num;
+                break;
+            case 'c':
+                if (!parse_tolerance(optarg, args.converge_tol))
+                    exit_on_error("Bad convergence tolerance (" + std::string(optarg) + ")");
+                break;
+            case 'm':
+                args.mem_spec = optarg;
+                break;
+            case 'q':
+                if (!parse_queue_sizes(optarg, args.fetch_q_size, args.disp_q_size))
+                    print_usage();
+                break;
+            case 'x':
+                if (!parse_fu_latencies(optarg, args.latency, args.pipelined))
+                    print_usage();
+                break;
+            case 'z':
+                args.memo = 1;
+                break;
+            case 'Z':
+                args.memo = 2;
+                break;
+            case 'a':
+                args.analyze = true;
+                break;
+            case 'v': {
+                // Instruction window FIRST:LAST; LAST may be omitted for "to the end"
+                char* end = NULL;
+                args.view_first = strtoll(optarg, &end, 10);
+                args.view_last = (*end == ':' && end[1] != '\0') ? strtoll(end + 1, NULL, 10) : INT64_MAX;
+
+                if (args.view_first < 1 || args.view_last < args.view_first)
+                    print_usage();
+                break;
+            }
             case '?':
             default:
                 print_usage();
         }
     }
 
+    // Analysis only needs the trace; a simulation needs the whole machine
+    if (argc < (args.analyze ? 2 : 12))
+        print_usage();
+
     if (args.trace_file.empty())
         args.trace_file = argv[argc-1];
 }
 
-void parse_trace(std::string file, std::vector<Instruction>& instructions) {
-    std::ifstream trace_file (file);
+bool parse_queue_sizes(const std::string& spec, int& fetch_q_size, int& disp_q_size) {
+    char* end = NULL;
+    long f = strtol(spec.c_str(), &end, 10);
+    long d = f;
+
+    if (end == spec.c_str())
+        return false;
+
+    if (*end == ':')
+        d = strtol(end + 1, &end, 10);
+
+    if (*end != '\0' || f < 0 || d < 0 || f > INT_MAX || d > INT_MAX)
+        return false;
+
+    fetch_q_size = static_cast<int>(f);
+    disp_q_size = static_cast<int>(d);
+    return true;
+}
+
+bool parse_tolerance(const std::string& s, double& tol) {
+    char* end = NULL;
+    double v = strtod(s.c_str(), &end);
+
+    if (end == s.c_str() || *end != '\0' || !std::isfinite(v) || v <= 0)
+        return false;
+
+    tol = v;
+    return true;
+}
+
+bool parse_fu_latencies(const std::string& spec, int latency[3], bool pipelined[3]) {
+    const char* p = spec.c_str();
 
-    if (!trace_file.is_open())
-        exit_on_error("Unable to open trace file specified (" + file + ")");
+    for (int i = 0; i < 3; i++) {
+        char* end = NULL;
+        long lat = strtol(p, &end, 10);
 
-    int idx = 0;
-    std::string line;
+        if (end == p || lat < 1 || lat > 1024)
+            return false;
+
+        latency[i] = static_cast<int>(lat);
+        pipelined[i] = *end == 'p';
+
+        if (pipelined[i])
+            end++;
+
+        if (*end != (i < 2 ? ',' : '\0'))
+            return false;
+
+        p = end + 1;
+    }
+
+    return true;
+}
+
+// Advance past spaces/tabs (and a stray CR) within a line
+static inline const char* skip_ws(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+// Decode a hex field; returns pointer past the last digit consumed, or NULL
+// if the value doesn't fit a non-negative int64_t
+static inline const char* parse_hex(const char* p, const char* end, int64_t& out) {
+    uint64_t v = 0;
+
+    if (end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        p += 2;
+
+    for (; p < end; p++) {
+        unsigned int c = static_cast<unsigned char>(*p);
+        unsigned int d = c - '0';
+
+        if (d > 9) {
+            // Fold case; maps 'a'-'f' and 'A'-'F' onto 10-15
+            d = (c | 0x20) - 'a';
+            if (d > 5)
+                break;
+            d += 10;
+        }
+
+        if (v >> 59)
+            return NULL;
+
+        v = (v << 4) | d;
+    }
+
+    out = static_cast<int64_t>(v);
+    return p;
+}
+
+// Decode a (possibly negative) decimal field; huge values saturate
+template <typename T>
+static inline const char* parse_dec(const char* p, const char* end, T& out) {
+    bool neg = false;
+    int v = 0;
+
+    if (p < end && *p == '-') {
+        neg = true;
+        p++;
+    }
+
+    for (; p < end; p++) {
+        unsigned int d = static_cast<unsigned char>(*p) - '0';
+        if (d > 9)
+            break;
+        v = v < 100000000 ? v * 10 + static_cast<int>(d) : INT_MAX;
+    }
+
+    out = static_cast<T>(neg ? -v : v);
+    return p;
+}
+
+// Why a chunk stopped parsing early
+enum ChunkError : char {
+    CHUNK_OK,
+    CHUNK_BAD_ADDRESS, // Doesn't fit in 64 bits
+    CHUNK_BAD_REGISTER // Outside -1..127
+};
+
+// Parse all lines in [begin, end) into out; begin must be at the start of a
+// line. Stops at the first field out of range and sets error.
+static void parse_chunk(const char* begin, const char* end, std::vector<Instruction>& out, char& error) {
+    const char* p = begin;
     Instruction inst;
+    int taken;
+    int regs[3];
 
-    while (getline(trace_file, line)) {
-        std::istringstream iss (line);
+    // Rough estimate of one instruction per 20 bytes
+    out.reserve((end - begin) / 20 + 1);
+
+    while (p < end) {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (eol == NULL)
+            eol = end;
 
         inst = {};
-        iss >> std::hex >> inst.addr >> std::dec;
-        iss >> inst.fu_type;
-        iss >> inst.dest_reg;
-        iss >> inst.src_reg[0];
-        iss >> inst.src_reg[1];
+        p = skip_ws(p, eol);
+        p = parse_hex(p, eol, inst.addr);
+        if (p == NULL) {
+            error = CHUNK_BAD_ADDRESS;
+            return;
+        }
+
+        p = parse_dec(skip_ws(p, eol), eol, inst.fu_type);
+
+        // Registers are stored in a byte, so check them before narrowing
+        for (int r = 0; r < 3; r++) {
+            p = parse_dec(skip_ws(p, eol), eol, regs[r]);
+
+            if (regs[r] < -1 || regs[r] > 127) {
+                error = CHUNK_BAD_REGISTER;
+                return;
+            }
+        }
+
+        inst.dest_reg = static_cast<int8_t>(regs[0]);
+        inst.src_reg[0] = static_cast<int8_t>(regs[1]);
+        inst.src_reg[1] = static_cast<int8_t>(regs[2]);
 
         // If branch line, extract branch address and taken flag
-        if (!iss.eof()) {
-            iss >> std::hex >> inst.branch_addr >> std::dec;
-            iss >> inst.taken;
+        p = skip_ws(p, eol);
+        if (p < eol) {
+            p = parse_hex(p, eol, inst.branch_addr);
+            if (p == NULL) {
+                error = CHUNK_BAD_ADDRESS;
+                return;
+            }
+
+            p = parse_dec(skip_ws(p, eol), eol, taken);
+            inst.taken = taken != 0;
         }
 
-        inst.idx = idx++;
+        out.push_back(inst);
+        p = eol + 1;
+    }
+}
+
+void parse_trace(std::string file, std::vector<Instruction>& instructions, int num_threads) {
+    std::string err;
+
+    if (!load_trace(file, instructions, err, num_threads))
+        exit_on_error(err);
+}
+
+bool load_trace(const std::string& file, std::vector<Instruction>& instructions, std::string& err, int num_threads) {
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+        err = "Unable to open trace file specified (" + file + ")";
+        return false;
+    }
+
+    struct stat sb;
+
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        err = "Unable to stat trace file (" + file + ")";
+        return false;
+    }
+
+    size_t size = static_cast<size_t>(sb.st_size);
+
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        err = "Unable to map trace file (" + file + ")";
+        return false;
+    }
+
+    // Whole file is read front to back exactly once
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char* data = static_cast<const char*>(map);
+    const char* end = data + size;
+
+    // Don't bother splitting small traces; thread startup would dominate
+    const size_t min_chunk = 1 << 20;
+
+    if (num_threads <= 0)
+        num_threads = static_cast<int>(std::thread::hardware_concurrency());
+
+    num_threads = static_cast<int>(std::min<size_t>(std::max(num_threads, 1), size / min_chunk + 1));
+
+    // Chunk boundaries, each moved forward to the start of the next line
+    std::vector<const char*> bounds;
+    bounds.push_back(data);
+
+    for (int i = 1; i < num_threads; i++) {
+        const char* b = data + (size * i) / num_threads;
+
+        if (b < bounds.back())
+            b = bounds.back();
+
+        const char* nl = static_cast<const char*>(memchr(b, '\n', end - b));
+        bounds.push_back(nl == NULL ? end : nl + 1);
+    }
+
+    bounds.push_back(end);
+
+    std::vector<std::vector<Instruction>> parts (num_threads);
+    std::vector<char> errors (num_threads, CHUNK_OK);
+    std::vector<std::thread> workers;
+
+    for (int i = 1; i < num_threads; i++)
+        workers.push_back(std::thread(parse_chunk, bounds[i], bounds[i+1], std::ref(parts[i]), std::ref(errors[i])));
+
+    // Calling thread takes the first chunk
+    parse_chunk(bounds[0], bounds[1], parts[0], errors[0]);
+
+    for (std::thread& t: workers)
+        t.join();
+
+    munmap(map, size);
+
+    // Report the first bad field in trace order
+    for (char e: errors) {
+        if (e == CHUNK_BAD_ADDRESS)
+            err = "Address out of range in trace file (" + file + ")";
+        else if (e == CHUNK_BAD_REGISTER)
+            err = "Register number out of range in trace file (" + file + ")";
+
+        if (e != CHUNK_OK)
+            return false;
+    }
+
+    // Stitch the chunks back together in trace order
+    size_t total = instructions.size();
+    for (std::vector<Instruction>& part: parts)
+        total += part.size();
+
+    instructions.reserve(total);
 
-        instructions.push_back(inst);
+    for (std::vector<Instruction>& part: parts) {
+        instructions.insert(instructions.end(), part.begin(), part.end());
+        std::vector<Instruction>().swap(part);
     }
 
-    trace_file.close();
+    return true;
 }